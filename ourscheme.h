@@ -0,0 +1,50 @@
+#ifndef OURSCHEME_H
+#define OURSCHEME_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ourscheme{
+
+namespace internal{ struct Session; }
+
+enum class ValueKind{ NONE, NIL, T, INT, FLOAT, STRING, SYMBOL, PROCEDURE, LIST };
+
+struct Value{
+    ValueKind kind = ValueKind::NONE;
+    int intValue = 0;
+    float floatValue = 0;
+    std::string text;         // string contents, symbol name or procedure name
+    std::vector<Value> items; // elements of a LIST
+    std::vector<Value> tail;  // the final cdr of an improper LIST, if any
+};
+
+struct Result{
+    bool ok = true;
+    Value value;              // value of the last form that produced one
+    std::string output;       // everything the REPL would have printed
+    std::string error;        // message of the error that stopped evaluation
+};
+
+// One isolated OurScheme environment. Forms evaluated by eval() keep their
+// definitions for later calls; copying an Interpreter copies its definitions,
+// so a prelude can be loaded once and shared by many copies.
+class Interpreter{
+public:
+    Interpreter();
+    Interpreter(const Interpreter& base);
+    Interpreter& operator=(const Interpreter&) = delete;
+    ~Interpreter();
+
+    bool load(const std::string& path);
+    bool loadimage(const std::string& path);
+    Result eval(std::string_view source);
+
+private:
+    internal::Session* state;
+};
+
+}
+
+#endif
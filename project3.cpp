@@ -3,10 +3,45 @@
 #include <vector>
 #include <cctype>
 #include <fstream>
-#include <iomanip>
 #include <sstream>
 #include <map>
 #include <set>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <string_view>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <csetjmp>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "ourscheme.h"
+
+// Everything but the ourscheme::Interpreter API lives in ourscheme::internal,
+// so a program linking the library can use names like eval or list itself.
+namespace ourscheme::internal{
 
 using namespace std;
 
@@ -22,19 +57,141 @@ enum class tokentype{
     QUOTE,         //8
     SYMBOL,        //9
     ATOM,          //10
+    FUTURE,        //11
+    PROMISE,       //12
 };
 
 enum class nodetype{ ATOM, CONS, NIL };
 
+// Operand types a call site has seen so far; GENERIC once they varied.
+enum class spectype{ NONE, INT, FLOAT, GENERIC };
+
 struct Token{
     tokentype type;
     string content;
     int col;
     int row;
+    int line = 0;    // line and column in the whole input, which row and col
+    int column = 0;  // count from the start of the current form
 
     Token(tokentype t, string c, int column, int rownum) : type(t), content(c), col(column), row(rownum) {}
 };
 
+struct Future;
+struct Promise;
+struct UserFunction;
+struct TreeNode;
+
+// What a symbol reference resolved to in one session at one environment
+// version. A record is never changed once published, so a reader always sees
+// a session, version and binding that belong together. A node keeps one
+// record for each of the last few sessions that evaluated it, chained through
+// next, so sessions sharing a prelude do not keep replacing each other's.
+struct Binding{
+    Session* owner;
+    int version;
+    bool local;       // the name is also some procedure's parameter
+    TreeNode* value;  // the global binding, or nullptr
+    const Binding* next;
+};
+
+const int cachedsessions = 4;
+
+// Cache records replaced by a miss, and native code replaced by a recompile,
+// may still be in use on another thread, so they are retired rather than
+// freed. Every thread using them announces the epoch it has seen before each
+// use (0 while it uses none, between forms or waiting for work); something
+// retired at epoch e is released once each announced epoch is past e.
+struct Retired{
+    void* item;
+    void (*release)(void*);
+    unsigned long long epoch;
+};
+
+struct EpochReader{
+    atomic<unsigned long long> epoch{0};
+    vector<Retired> retired;
+    ~EpochReader();
+};
+
+atomic<unsigned long long> sharedepoch{1};
+mutex readerlock;
+vector<EpochReader*> readers;
+vector<Retired> orphans;  // left by exited threads
+thread_local EpochReader* epochreader = nullptr;
+
+const size_t retirebatch = 4096;
+
+EpochReader::~EpochReader(){
+    lock_guard<mutex> guard(readerlock);
+    readers.erase(find(readers.begin(), readers.end(), this));
+    orphans.insert(orphans.end(), retired.begin(), retired.end());
+}
+
+// Called before a thread loads something that may be retired. Coming back
+// from using none needs a full fence, so a reclaimer either sees the epoch or
+// the thread sees what was replaced meanwhile.
+void announceepoch(){
+    if(epochreader == nullptr){
+        thread_local EpochReader reader;
+        lock_guard<mutex> guard(readerlock);
+        readers.push_back(&reader);
+        epochreader = &reader;
+    }
+
+    if(epochreader->epoch.load(memory_order_relaxed) == 0)
+        epochreader->epoch.store(sharedepoch.load(), memory_order_seq_cst);
+    else epochreader->epoch.store(sharedepoch.load(), memory_order_release);
+}
+
+void leaveepoch(){
+    if(epochreader != nullptr) epochreader->epoch.store(0, memory_order_release);
+}
+
+void releaseretired(vector<Retired>& retired, unsigned long long oldest){
+    size_t kept = 0;
+    for(Retired& item : retired){
+        if(item.epoch < oldest) item.release(item.item);
+        else retired[kept++] = item;
+    }
+
+    retired.resize(kept);
+}
+
+// Releases what the calling thread retired that no other thread can still
+// use; the caller uses none of it itself while it retires.
+void reclaimretired(){
+    sharedepoch++;
+    lock_guard<mutex> guard(readerlock);
+    unsigned long long oldest = ULLONG_MAX;
+    for(EpochReader* reader : readers){
+        unsigned long long seen = reader->epoch.load(memory_order_acquire);
+        if(reader != epochreader && seen != 0) oldest = min(oldest, seen);
+    }
+
+    releaseretired(epochreader->retired, oldest);
+    releaseretired(orphans, oldest);
+}
+
+// Cache records are retired in batches; native code, which holds a whole
+// mapping, is reclaimed at once.
+void retire(void* item, void (*release)(void*), bool batched){
+    epochreader->retired.push_back({ item, release, sharedepoch.load() });
+    if(!batched || epochreader->retired.size() >= retirebatch) reclaimretired();
+}
+
+void releasebindings(void* item){
+    for(const Binding* cur = (const Binding*)item; cur != nullptr; ){
+        const Binding* next = cur->next;
+        delete cur;
+        cur = next;
+    }
+}
+
+thread_local long long nodesallocated = 0;
+thread_local long long nodeceiling = LLONG_MAX;
+void nodecheckpoint();
+
 struct TreeNode{
     nodetype type;
     tokentype atomtype;
@@ -43,56 +200,434 @@ struct TreeNode{
     TreeNode* left;
     TreeNode* right;
 
-    TreeNode(string c, tokentype t) : type(nodetype::ATOM), atomtype(t), content(c), left(nullptr), right(nullptr) {}
+    atomic<const Binding*> binding{nullptr};
+    Future* future = nullptr;
+    Promise* promise = nullptr;
+    atomic<spectype> spec{spectype::NONE};
+    atomic<TreeNode*> expansion{nullptr};
+    atomic<UserFunction*> function{nullptr};  // a procedure's body, or a lambda form's shared one
+    atomic<uint8_t> checked{0};
+    int line = 0;    // where a list form starts in its source, 0 if unknown
+    int column = 0;
+
+    TreeNode(string c, tokentype t) : type(nodetype::ATOM), atomtype(t), content(c), left(nullptr), right(nullptr) { if(++nodesallocated > nodeceiling) nodecheckpoint(); }
 
-    TreeNode(string c, TreeNode* l, TreeNode* r) : type(nodetype::CONS), content(c), left(l), right(r) {}
+    TreeNode(string c, TreeNode* l, TreeNode* r) : type(nodetype::CONS), content(c), left(l), right(r) { if(++nodesallocated > nodeceiling) nodecheckpoint(); }
     
-    TreeNode(nodetype t) : type(nodetype::NIL), left(nullptr), right(nullptr) {} 
+    TreeNode(nodetype t) : type(nodetype::NIL), left(nullptr), right(nullptr) { if(++nodesallocated > nodeceiling) nodecheckpoint(); } 
 };
 
+const int specwidth = 8;
+
+// Shape checks a form has passed; a form never changes, so they hold for good.
+const uint8_t checkedlist = 1;
+const uint8_t checkedif = 2;
+const uint8_t checkedcond = 4;
+const uint8_t checkeddo = 8;
+
+bool ischecked(TreeNode* node, uint8_t check){
+    return (node->checked.load(memory_order_relaxed) & check) != 0;
+}
+
+void markchecked(TreeNode* node, uint8_t check){
+    node->checked.fetch_or(check, memory_order_relaxed);
+}
+
 struct Numbertype{
     bool isFloat;
     float floatValue;
     int intValue;
 };
 
+struct JitCode;
+
 struct UserFunction {
     vector<string> parameters;
     TreeNode* body; 
+    atomic<int> calls{0};
+    atomic<int> bails{0};
+    atomic<bool> nojit{false};
+    atomic<JitCode*> code{nullptr};
+    TreeNode* loop = nullptr;  // for a named let, the procedure its name is bound to
 
     UserFunction(vector<string> p, TreeNode* b) : parameters(p), body(b) {}
 };
 
+// Thrown by the evaluator and caught by whoever prints the error; type keeps
+// the numbering printevalerror() understands.
+struct EvalError{
+    int type;
+    string op;
+    TreeNode* token;
+
+    EvalError(int t, string o, TreeNode* k) : type(t), op(o), token(k) {}
+};
+
 
 set<string> reserved = {
     "cons", "list", "quote", "define", "car", "cdr", "atom?", "pair?", "list?", "null?", "integer?", "real?", "exit",
     "number?", "string?", "boolean?", "symbol?", "+", "-", "*", "/", "not", "and", "or", ">", ">=", "<", "<=", "=", 
     "string-append", "string>?", "string<?", "string=?", "eqv?", "equal?", "begin", "if", "cond", "clean-environment",
-    "let", "lambda", "verbose?", "verbose"
+    "let", "lambda", "verbose?", "verbose", "save-image", "pmap", "pfor-each",
+    "future", "touch", "delay", "force", "make-promise", "cons-stream", "stream-car", "stream-cdr",
+    "define-syntax", "length", "append", "reverse", "map", "filter", "fold", "assoc", "member",
+    "sort", "do"
+};
+
+thread_local int col = 0;
+thread_local int row = 1;
+thread_local int lp = 0;
+thread_local int rp = 0;
+thread_local int q = 0;
+thread_local int errortype = 0;
+thread_local bool existtree = false;
+thread_local bool syntaxerror = false;
+thread_local bool eof = false;
+thread_local bool after = true;
+thread_local bool needprint = true;
+thread_local vector<Token> tokens;
+thread_local istream* instream = &cin;
+thread_local ostream* outstream = &cout;
+thread_local Token errortoken(tokentype::SYMBOL, "ERROR", 0, 0);
+thread_local TreeNode* rootform = nullptr;
+thread_local int errorsreported = 0;
+thread_local int inputline = 0;  // lines read from instream so far
+
+thread_local map<string, TreeNode*> localtable;
+set<string> localnames;
+mutex localnamelock;
+atomic<int> versioncounter(0);
+
+// Limits on each top-level form, from --max-steps, --max-nodes and
+// --timeout (milliseconds); 0 leaves that limit off.
+long long maxsteps = 0;
+long long maxnodes = 0;
+long long timeoutms = 0;
+bool budgeted = false;
+
+// A form's budget is shared with every task it starts (pmap, pfor-each,
+// future, parallel sort), so work moved onto other threads still counts
+// against the form's steps, nodes and deadline.
+struct Budget{
+    atomic<long long> steps{0};
+    atomic<long long> nodes{0};  // nodes allocated so far, over all threads
+    chrono::steady_clock::time_point deadline;
+};
+
+thread_local shared_ptr<Budget> budget;
+thread_local const atomic<bool>* cancelflag = nullptr;  // set while running a future, see cancelfutures()
+thread_local long long nodebase = 0;  // nodesallocated when last added to budget->nodes
+thread_local char* stacklimit = nullptr;
+
+// Recursion runs out of C++ stack long before a step limit is reached, so
+// budgeted evaluation also stops while some of the thread's stack is left.
+char* findstacklimit(){
+    pthread_attr_t attr;
+    void* base = nullptr;
+    size_t size = 0;
+    if(pthread_getattr_np(pthread_self(), &attr) == 0){
+        pthread_attr_getstack(&attr, &base, &size);
+        pthread_attr_destroy(&attr);
+    }
+
+    return (char*)base + min<size_t>(size / 4, 256 * 1024);
+}
+
+// Node allocations are checked whenever nodesallocated passes nodeceiling,
+// at least every nodestride nodes while a budgeted form runs, so a single
+// builtin copying a huge structure is still cut off.
+const long long nodestride = 65536;
+
+void setceiling(){
+    nodeceiling = nodesallocated + nodestride;
+    if(maxnodes > 0) nodeceiling = min(nodeceiling, nodesallocated + max(0LL, maxnodes - budget->nodes));
+}
+
+// Adds the nodes this thread allocated since the last call to its budget.
+void flushnodes(){
+    if(budget != nullptr) budget->nodes += nodesallocated - nodebase;
+    nodebase = nodesallocated;
+}
+
+void stopbudget(){
+    flushnodes();
+    nodeceiling = LLONG_MAX;
+}
+
+// Switches this thread over to charging shared.
+void adoptbudget(shared_ptr<Budget> shared){
+    stopbudget();
+    budget = move(shared);
+    if(budget != nullptr && (maxnodes > 0 || timeoutms > 0)) setceiling();
+}
+
+void startbudget(){
+    shared_ptr<Budget> fresh;
+    if(budgeted){
+        fresh = make_shared<Budget>();
+        if(timeoutms > 0) fresh->deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutms);
+    }
+    adoptbudget(move(fresh));
+}
+
+// Runs a task under the budget and cancellation flag of the form that
+// started it, giving the thread its own back afterwards.
+struct TaskScope{
+    shared_ptr<Budget> saved;
+    const atomic<bool>* savedcancel;
+
+    TaskScope(shared_ptr<Budget> shared, const atomic<bool>* cancel) : saved(budget), savedcancel(cancelflag) {
+        adoptbudget(move(shared));
+        cancelflag = cancel;
+    }
+
+    ~TaskScope(){
+        adoptbudget(move(saved));
+        cancelflag = savedcancel;
+    }
+};
+
+void nodecheckpoint(){
+    stopbudget();
+    if(budget == nullptr) return;
+    if(maxnodes > 0 && budget->nodes > maxnodes) throw EvalError(16, "node", nullptr);
+    if(timeoutms > 0 && chrono::steady_clock::now() > budget->deadline) throw EvalError(16, "time", nullptr);
+
+    setceiling();
+}
+
+// Whether eval has to call countstep(): a limit is set, or a future is
+// running that its session may cancel.
+bool checksteps(){
+    return budgeted || cancelflag != nullptr;
+}
+
+// One evaluation step. Steps and stack depth are compared on every call,
+// the clock only every 1024 steps, to keep the check off the profile.
+void countstep(){
+    char here;
+    if(stacklimit == nullptr) stacklimit = findstacklimit();
+    if(&here < stacklimit) throw EvalError(16, "stack", nullptr);
+    if(cancelflag != nullptr && cancelflag->load(memory_order_relaxed)) throw EvalError(17, "", nullptr);
+
+    if(budget == nullptr) return;
+    long long steps = ++budget->steps;
+    if(maxsteps > 0 && steps > maxsteps) throw EvalError(16, "step", nullptr);
+    if((steps & 1023) != 0) return;
+
+    if(timeoutms > 0 && chrono::steady_clock::now() > budget->deadline) throw EvalError(16, "time", nullptr);
+}
+
+// Sampling profiler. eval() keeps a shadow stack of the calls it is inside,
+// as (call form, procedure label) pairs; on every SIGPROF the handler copies
+// the interrupted thread's stack into profilebuffer. Consecutive samples of a
+// thread share most of their frames, so each sample only stores the frames
+// past the prefix it has in common with that thread's previous one.
+const int profiledepth = 4096;
+const size_t profilecapacity = (size_t)1 << 24;
+
+bool profiling = false;
+uintptr_t* profilebuffer = nullptr;
+atomic<size_t> profileused(0);
+atomic<long long> profiledropped(0);
+atomic<int> profilethreads(0);
+
+// A thread's shadow stack and the frames of its last sample. It is allocated
+// the first time the thread enters a call while profiling, so threads carry
+// none of it when --profile is off.
+struct ProfileStack{
+    TreeNode* calls[profiledepth];
+    TreeNode* funcs[profiledepth];
+    TreeNode* last[2 * profiledepth];
+    int lastdepth = 0;
+    int thread = 0;
+};
+
+thread_local ProfileStack* profilestack = nullptr;
+thread_local int profiletop = 0;
+
+// Frees the thread's stack when it exits, after the handler can no longer see it.
+struct ProfileStackOwner{
+    ProfileStack* stack = nullptr;
+
+    ~ProfileStackOwner(){
+        profilestack = nullptr;
+        atomic_signal_fence(memory_order_seq_cst);
+        delete stack;
+    }
+};
+
+void startprofilestack(){
+    thread_local ProfileStackOwner owner;
+    owner.stack = new ProfileStack();
+    owner.stack->thread = ++profilethreads;
+    atomic_signal_fence(memory_order_release);
+    profilestack = owner.stack;
+}
+
+// A sample is [depth + 1, thread << 1 | truncated, shared prefix, frames...];
+// the first slot is written last, so a reader stops at a sample still being
+// written. A thread that has made no call yet samples as thread 0 at top level.
+void profilesample(int){
+    ProfileStack* stack = profilestack;
+    int top = stack != nullptr ? profiletop : 0;
+    atomic_signal_fence(memory_order_acquire);
+    int depth = min(top, profiledepth);
+
+    int shared = 0;
+    while(shared < depth && shared < stack->lastdepth && stack->last[2 * shared] == stack->calls[shared]
+          && stack->last[2 * shared + 1] == stack->funcs[shared])
+        shared++;
+
+    size_t need = 3 + 2 * (size_t)(depth - shared);
+    size_t at = profileused.fetch_add(need, memory_order_relaxed);
+    if(at + need > profilecapacity){
+        profiledropped++;
+        return;
+    }
+
+    uintptr_t* sample = profilebuffer + at;
+    sample[1] = (uintptr_t)(stack != nullptr ? stack->thread : 0) << 1 | (top > profiledepth);
+    sample[2] = shared;
+    for(int i = shared; i < depth; i++){
+        stack->last[2 * i] = stack->calls[i];
+        stack->last[2 * i + 1] = stack->funcs[i];
+        sample[3 + 2 * (i - shared)] = (uintptr_t)stack->calls[i];
+        sample[4 + 2 * (i - shared)] = (uintptr_t)stack->funcs[i];
+    }
+
+    if(stack != nullptr) stack->lastdepth = depth;
+    __atomic_store_n(&sample[0], (uintptr_t)depth + 1, __ATOMIC_RELEASE);
+}
+
+// Pushes one call for the profiler while it is in scope.
+struct ProfileFrame{
+    bool pushed = false;
+
+    ProfileFrame(TreeNode* call, TreeNode* func){
+        if(!profiling) return;
+        if(profilestack == nullptr) startprofilestack();
+
+        if(profiletop < profiledepth){
+            profilestack->calls[profiletop] = call;
+            profilestack->funcs[profiletop] = func;
+        }
+
+        atomic_signal_fence(memory_order_release);
+        profiletop++;
+        pushed = true;
+    }
+
+    ~ProfileFrame(){
+        if(pushed) profiletop--;
+    }
+};
+
+// Samples every millisecond of CPU time the process uses, on any thread.
+bool startprofile(){
+    profilebuffer = (uintptr_t*)calloc(profilecapacity, sizeof(uintptr_t));
+    if(profilebuffer == nullptr) return false;
+
+    struct sigaction action = {};
+    action.sa_handler = profilesample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(SIGPROF, &action, nullptr) != 0) return false;
+
+    profiling = true;
+    struct itimerval timer = {};
+    timer.it_interval.tv_usec = 1000;
+    timer.it_value.tv_usec = 1000;
+    return setitimer(ITIMER_PROF, &timer, nullptr) == 0;
+}
+
+// Tracing. Every thread appends complete events to a log of its own, which
+// is registered once so writetrace() can merge the logs at exit. An event
+// with no phase is a user function call.
+struct TraceEvent{
+    const char* phase;
+    TreeNode* call;
+    TreeNode* func;
+    long long begin;
+    long long end;
+};
+
+struct TraceLog{
+    int thread;
+    mutex lock;
+    vector<TraceEvent> events;
+};
+
+bool tracing = false;
+bool tracecalls = false;
+chrono::steady_clock::time_point tracestart;
+mutex tracelock;
+vector<TraceLog*> tracelogs;
+thread_local TraceLog* tracelog = nullptr;
+
+long long tracenow(){
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - tracestart).count();
+}
+
+// Records the time from construction to destruction as one event.
+struct TraceSpan{
+    const char* phase = nullptr;
+    TreeNode* call = nullptr;
+    TreeNode* func = nullptr;
+    long long begin = -1;
+
+    TraceSpan(const char* name, TreeNode* form = nullptr) : phase(name), call(form) {
+        if(tracing) begin = tracenow();
+    }
+
+    TraceSpan(TreeNode* label, TreeNode* node) : call(node), func(label) {
+        if(tracecalls) begin = tracenow();
+    }
+
+    ~TraceSpan(){
+        if(begin < 0) return;
+
+        long long end = tracenow();
+        if(tracelog == nullptr){
+            lock_guard<mutex> guard(tracelock);
+            tracelog = new TraceLog();
+            tracelog->thread = tracelogs.size() + 1;
+            tracelogs.push_back(tracelog);
+        }
+
+        lock_guard<mutex> guard(tracelog->lock);
+        tracelog->events.push_back({ phase, call, func, begin, end });
+    }
+};
+
+struct Macro;
+
+struct Session{
+    map<string, TreeNode*> definetable;
+    map<string, string> functionalias;
+    map<string, Macro*> macros;
+    bool verbose;
+    atomic<int> envversion;
+    atomic<int> pendingfutures{0};
+    shared_ptr<atomic<bool>> cancelled = make_shared<atomic<bool>>(false);  // shared by the futures started since the last cancelfutures()
+
+    // Futures read the tables above while the session's own thread may define,
+    // so lookups hold envlock shared and changes hold it exclusively.
+    mutable shared_mutex envlock;
+
+    Session() : verbose(true), envversion(++versioncounter) {}
+
+    // A new environment starting with base's definitions, aliases and macros.
+    Session(const Session& base) : verbose(base.verbose), envversion(++versioncounter) {
+        shared_lock<shared_mutex> guard(base.envlock);
+        definetable = base.definetable;
+        functionalias = base.functionalias;
+        macros = base.macros;
+    }
 };
 
-int col = 0;
-int row = 1;
-int lp = 0;
-int rp = 0;
-int q = 0;
-int errortype = 0;
-int toplevel = 0;
-bool existtree = false;
-bool evalerror = false;
-bool syntaxerror = false;
-bool eof = false;
-bool after = true;
-bool needprint = true;
-bool verbose = true;
-string errorop = "";
-vector<Token> tokens;
-Token errortoken(tokentype::SYMBOL, "ERROR", 0, 0);
-TreeNode* evalerrortoken = new TreeNode(nodetype::NIL);
-map<string, TreeNode*> definetable;
-map<string, TreeNode*> localtable;
-map<string, string> functionalias;
-map<TreeNode*, UserFunction*> lambdatable;
+Session mainsession;
+thread_local Session* session = &mainsession;
 
 TreeNode* eval(TreeNode* node, bool islet = false);
 TreeNode* list(TreeNode* node);
@@ -121,31 +656,66 @@ void reset(){
     errortype = 0;
     existtree = false;
     syntaxerror = false;
-    evalerror = false;
     eof = false;
     needprint = true;
-    toplevel = 0;
-    errorop = "";
+    rootform = nullptr;
     tokens = {};
 }
 
-bool alldigit(string &inp){
-    int count = col + 1;
-    while(count < inp.size() && !isspace(inp[count])){
-        if(inp[count] == ';'){
-            col = count ;
-            return true;
-        }
+// What scanfrom() skips over: whitespace, the characters of a symbol or a
+// number's digits, or the plain characters of a string literal.
+enum class scantype{ SPACE, SYMBOL, DIGIT, STRING };
 
-        if(inp[count] == '(' || inp[count] == ')'){
-            col = count;
-            return true;
-        } //如: .4389(1 2)
+bool scanstop(scantype type, unsigned char c){
+    bool space = c == ' ' || (c >= '\t' && c <= '\r');
+    if(type == scantype::SPACE) return !space;
+    if(type == scantype::SYMBOL) return space || c == '(' || c == ')' || c == ';' || c == '\'' || c == '"';
+    if(type == scantype::DIGIT) return !isdigit(c);
+    return c == '"' || c == '\\';
+}
 
-        if(!isdigit(inp[count])) return false;
+#if defined(__SSE2__)
 
-        count++;
-    } 
+// Bit i is set when byte i of the 16 loaded would stop the scan.
+uint32_t stopmask(scantype type, __m128i bytes){
+    auto equal = [&](char c){ return _mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)); };
+    auto within = [&](char low, char count){
+        __m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8(low));
+        return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(count - 1)), offset);
+    };
+
+    __m128i space = _mm_or_si128(equal(' '), within('\t', 5));
+    if(type == scantype::SPACE) return ~_mm_movemask_epi8(space) & 0xFFFF;
+    if(type == scantype::DIGIT) return ~_mm_movemask_epi8(within('0', 10)) & 0xFFFF;
+    if(type == scantype::STRING) return _mm_movemask_epi8(_mm_or_si128(equal('"'), equal('\\')));
+
+    __m128i delimiter = _mm_or_si128(_mm_or_si128(equal('('), equal(')')), _mm_or_si128(equal(';'), equal('\'')));
+    return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(space, delimiter), equal('"')));
+}
+
+#endif
+
+// Index of the first byte at or after from that stops a scan of the given
+// type, or inp.size(). Long runs are classified 32 bytes at a time.
+int scanfrom(const string& inp, int from, scantype type){
+    size_t i = from;
+#if defined(__SSE2__)
+    const char* data = inp.data();
+    for(; i + 32 <= inp.size(); i += 32){
+        uint32_t mask = stopmask(type, _mm_loadu_si128((const __m128i*)(data + i)))
+                      | stopmask(type, _mm_loadu_si128((const __m128i*)(data + i + 16))) << 16;
+        if(mask != 0) return i + __builtin_ctz(mask);
+    }
+#endif
+    while(i < inp.size() && !scanstop(type, inp[i])) i++;
+    return i;
+}
+
+bool alldigit(string &inp){
+    int count = scanfrom(inp, col + 1, scantype::DIGIT);
+    //如: .4389(1 2)
+    if(count < inp.size() && !isspace(inp[count]) && inp[count] != ';' && inp[count] != '(' && inp[count] != ')')
+        return false;
 
     col = count;
     return true;
@@ -153,22 +723,51 @@ bool alldigit(string &inp){
 
 Token returnsymbol(string &inp){
     int start = col;
-
-    while(col < inp.size() && !isspace(inp[col]) && inp[col] != '(' && inp[col] != ')' && inp[col] != ';' && inp[col] != '\'' && inp[col] != '\"'){
-        col++;
-    }
+    col = scanfrom(inp, col, scantype::SYMBOL);
 
     return Token(tokentype::SYMBOL, inp.substr(start, col - start), start+1, row);
 }
 
-string roundto(string num) {
-    stringstream str(num);
-    double val;
-    str >> val;
+// Number text goes through from_chars/to_chars: no locale, no streams.
+int parseint(const string& text){
+    long long value = 0;
+    const char* first = text.data() + (!text.empty() && text[0] == '+');
+    if(from_chars(first, text.data() + text.size(), value).ec != errc::result_out_of_range)
+        return (int)value;
+
+    // past long long, keep wrapping the way the cast to int does
+    bool negative = *first == '-';
+    unsigned long long digits = 0;
+    for(const char* cur = first + negative; cur < text.data() + text.size() && isdigit((unsigned char)*cur); cur++)
+        digits = digits * 10 + (*cur - '0');
+
+    return (int)(negative ? 0 - digits : digits);
+}
+
+float parsefloat(const string& text){
+    float value = 0;
+    from_chars(text.data(), text.data() + text.size(), value);
+    return value;
+}
+
+string inttext(int value){
+    char buffer[16];
+    return string(buffer, to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+}
+
+// Floats keep the six fixed places to_string always gave them, so computed
+// values print and compare with eqv? as they did.
+string floattext(float value){
+    char buffer[64];
+    return string(buffer, to_chars(buffer, buffer + sizeof(buffer), value, chars_format::fixed, 6).ptr);
+}
+
+string roundto(const string& num) {
+    double val = 0;
+    from_chars(num.data(), num.data() + num.size(), val);
 
-    stringstream out;
-    out << fixed << setprecision(3) << val;
-    return out.str();
+    char buffer[400];
+    return string(buffer, to_chars(buffer, buffer + sizeof(buffer), val, chars_format::fixed, 3).ptr);
 }
 
 TreeNode* copy(TreeNode* node) {
@@ -176,6 +775,11 @@ TreeNode* copy(TreeNode* node) {
 
     TreeNode* newNode = new TreeNode(node->content, node->atomtype);
     newNode->type = node->type;
+    newNode->function.store(node->function.load(memory_order_relaxed), memory_order_relaxed);
+    newNode->future = node->future;
+    newNode->promise = node->promise;
+    newNode->line = node->line;
+    newNode->column = node->column;
 
     newNode->left = copy(node->left);
     newNode->right = copy(node->right);
@@ -184,20 +788,15 @@ TreeNode* copy(TreeNode* node) {
 }
 
 string erasezero(string num){
-    int i = 0;
-    while(i < num.size()-1){
-        if(num[i] == '0' && num[i+1] != '.'){
-            num.erase(0, 1);
-        }
-
-        else return num;
-    }
+    size_t zeros = 0;
+    while(zeros + 1 < num.size() && num[zeros] == '0' && num[zeros + 1] != '.')
+        zeros++;
 
-    return num;
+    return num.erase(0, zeros);
 }
 
 Token gettoken(string &inp){
-    while(col < inp.size() && isspace(inp[col])) col++; 
+    col = scanfrom(inp, col, scantype::SPACE);
 
     if(col >= inp.size()) return Token(tokentype::SYMBOL, "", col, row);
 
@@ -267,7 +866,12 @@ Token gettoken(string &inp){
                 col++;
             }
 
-            else    str = str + inp[col];
+            else{
+                int end = scanfrom(inp, col, scantype::STRING);
+                str.append(inp, col, end - col);
+                col = end;
+                continue;
+            }
 
             col++;
         }
@@ -278,12 +882,13 @@ Token gettoken(string &inp){
     if(isdigit(c) || ((c == '-' ||c == '+') && ( isdigit(inp[col + 1]) || inp[col + 1] == '.'))){
         int start = col;
         string num = "";
-        if(c == '-' || isdigit(c))  num = num + inp[col];
+        if(c == '-' || isdigit(c))  num += inp[col];
         col++;
         while(col < inp.size()){
             if(isdigit(inp[col])){
-                num = num + inp[col];
-                col++;
+                int end = scanfrom(inp, col, scantype::DIGIT);
+                num.append(inp, col, end - col);
+                col = end;
             }
 
             else if(isspace(inp[col])){
@@ -362,20 +967,34 @@ bool isreserved(string content){
     return reserved.find(content) != reserved.end();
 }
 
+void addlocalname(const string& name){
+    lock_guard<mutex> guard(localnamelock);
+    if(localnames.insert(name).second) session->envversion = ++versioncounter;
+}
+
+bool islocalname(const string& name){
+    lock_guard<mutex> guard(localnamelock);
+    return localnames.count(name) > 0;
+}
+
 bool readinput(){
+    TraceSpan span("read");
     string inp;
     col = 0;
-    if(!getline(cin, inp)){
+    if(!getline(*instream, inp)){
         eof = true;
         return false;
     }    
+
+    inputline++;
+    int cut = 0;
     
     if(inp == ""){
         row++;
         return readinput();
     }
 
-    while(col < inp.size() && isspace(inp[col])) col++; 
+    col = scanfrom(inp, col, scantype::SPACE);
     if(inp[col] == ';' || col == inp.size()){
         row++;
         return readinput();
@@ -383,6 +1002,8 @@ bool readinput(){
 
     while(col < inp.size()){
         Token token = gettoken(inp);
+        token.line = inputline;
+        token.column = cut + token.col;
         if(token.type == tokentype::LEFT_PAREN) lp++;
         else if(token.type == tokentype::RIGHT_PAREN) rp++;
         else if(token.type == tokentype::QUOTE){
@@ -394,6 +1015,7 @@ bool readinput(){
         
         if(lp == rp){
             inp = inp.substr(col, inp.size());
+            cut += col;
             col = 0;
             row = 1;
         }
@@ -431,6 +1053,8 @@ TreeNode* parse(vector<Token>& tokens, int& index){
         TreeNode* left = parse(tokens, index);
         if(syntaxerror) return nullptr;
         TreeNode* root = new TreeNode("(", left, nullptr);
+        root->line = token.line;
+        root->column = token.column;
         TreeNode* cur = root;
 
         while(index < tokens.size()){
@@ -578,6 +1202,8 @@ TreeNode* parse(vector<Token>& tokens, int& index){
         TreeNode* nil = new TreeNode(nodetype::NIL);
         TreeNode* rightsub = new TreeNode("", right, nil);
         TreeNode* full = new TreeNode("(", quote, rightsub);
+        full->line = token.line;
+        full->column = token.column;
 
         return full;
     }
@@ -609,19 +1235,19 @@ TreeNode* parse(vector<Token>& tokens, int& index){
 }
 
 TreeNode* checkpri(TreeNode* node){
-    if(isreserved(node->content) || functionalias.count(node->content) ){
-        TreeNode* temp = copy(node);
-        string pro = "#<procedure ";
-        if(isreserved(node->content))
-            pro = pro + node->content +">";
-        else
-            pro = pro + functionalias[node->content] +">";
-        
-        temp->content = pro;
-        return temp;
-    }    
+    string name;
+    if(isreserved(node->content))
+        name = node->content;
+    else{
+        shared_lock<shared_mutex> guard(session->envlock);
+        auto alias = session->functionalias.find(node->content);
+        if(alias == session->functionalias.end()) return nullptr;
+        name = alias->second;
+    }
 
-    return nullptr;
+    TreeNode* temp = copy(node);
+    temp->content = "#<procedure " + name + ">";
+    return temp;
 }
 
 string restorename(const string& str){
@@ -639,41 +1265,41 @@ bool isprocedure(const string& str){
 void print(TreeNode* root, int& lprint){
     if(root == nullptr) return;
     if(root->type == nodetype::ATOM){
-        for (int i = 0; i < lprint && !after; i++) cout << "  ";
+        for (int i = 0; i < lprint && !after; i++) *outstream << "  ";
         if(root->atomtype == tokentype::FLOAT)
-            cout << roundto(root->content) << endl;
+            *outstream << roundto(root->content) << endl;
         else
-            cout << root->content << endl;
+            *outstream << root->content << endl;
         after = false;
     }
     
     else if(root->type == nodetype::NIL){
         lprint--;
-        for (int i = 0; i < lprint && !after; i++) cout << "  ";
-        cout << ')' << endl;
+        for (int i = 0; i < lprint && !after; i++) *outstream << "  ";
+        *outstream << ')' << endl;
         after = false;
     }
     
     else if(root->type == nodetype::CONS){
         if(root->content == "("){
-            for (int i = 0; i < lprint && !after; i++) cout << "  ";
-            cout << "( ";
+            for (int i = 0; i < lprint && !after; i++) *outstream << "  ";
+            *outstream << "( ";
             lprint++;
             after = true;
         }
 
         print(root->left, lprint);
         if((root->left->type == nodetype::ATOM && root->right->type == nodetype::ATOM) || (root->left->content == "(" && root->right->type == nodetype::ATOM)){
-            for (int i = 0; i < lprint && !after; i++) cout << "  ";
-            cout << "." << endl;
+            for (int i = 0; i < lprint && !after; i++) *outstream << "  ";
+            *outstream << "." << endl;
         }
         
         print(root->right, lprint);
         
         if((root->left->type == nodetype::ATOM && root->right->type == nodetype::ATOM) ||(root->left->content == "(" && root->right->type == nodetype::ATOM)){
             lprint--;
-            for (int i = 0; i < lprint && !after; i++) cout << "  ";
-            cout << ")" << endl;
+            for (int i = 0; i < lprint && !after; i++) *outstream << "  ";
+            *outstream << ")" << endl;
             after = false;
         }
     }    
@@ -700,11 +1326,11 @@ TreeNode* makelist(vector<TreeNode*>& elems){
 
 Numbertype stringtrans(TreeNode* node){
     if(node->atomtype == tokentype::INT){
-        return { false, 0, std::stoi(node->content) };
+        return { false, 0, parseint(node->content) };
     }
     
     else if(node->atomtype == tokentype::FLOAT){
-        return { true, std::stof(node->content), 0 };
+        return { true, parsefloat(node->content), 0 };
     }
     
     return { false, 0, 0 };
@@ -712,23 +1338,28 @@ Numbertype stringtrans(TreeNode* node){
 
 TreeNode* makenumnode(bool isFloat, float floatVal, int intVal){
     if(isFloat)
-        return new TreeNode(to_string(floatVal), tokentype::FLOAT);
+        return new TreeNode(floattext(floatVal), tokentype::FLOAT);
     else
-        return new TreeNode(to_string(intVal), tokentype::INT);
+        return new TreeNode(inttext(intVal), tokentype::INT);
 }
 
-void nonlist(TreeNode* node, int error){
+bool islist(TreeNode* node){
     TreeNode* cur = node;
     while(cur->type != nodetype::NIL && cur->right != nullptr){
         cur = cur->right;
     }
-    
-    if(cur->type == nodetype::ATOM){
-        errortype = 4;
-        evalerrortoken = copy(node);    
-    }
 
-    else errortype = error;
+    return cur->type != nodetype::ATOM;
+}
+
+TreeNode* evalarg(TreeNode* node, int unbound = 7){
+    try{
+        return eval(node);
+    }
+    catch(EvalError& error){
+        if(error.type == 6) error.type = unbound;
+        throw;
+    }
 }
 
 bool ispredicates(const string& op){
@@ -754,164 +1385,166 @@ bool iscompare(const string& op){
 }
 
 
+// The session's global binding of name, or nullptr.
+TreeNode* definition(const string& name){
+    shared_lock<shared_mutex> guard(session->envlock);
+    auto def = session->definetable.find(name);
+    return def == session->definetable.end() ? nullptr : def->second;
+}
+
+TreeNode* lookup(TreeNode* node){
+    int version = session->envversion;
+    TreeNode* global = definition(node->content);
+    if(global == nullptr)
+        global = isprocedure(node->content) ? node : checkpri(node);
+
+    bool local = islocalname(node->content);
+    // the chain is copied, never shared, so the replaced one can be retired whole
+    Binding* fresh = new Binding{ session, version, local, global, nullptr };
+    Binding* last = fresh;
+    int kept = 1;
+    for(const Binding* cur = node->binding.load(); cur != nullptr && kept < cachedsessions; cur = cur->next){
+        if(cur->owner == session) continue;
+        Binding* other = new Binding(*cur);
+        other->next = nullptr;
+        last->next = other;
+        last = other;
+        kept++;
+    }
+
+    const Binding* replaced = node->binding.exchange(fresh);
+    if(replaced != nullptr) retire((void*)replaced, releasebindings, true);
+
+    auto binding = localtable.find(node->content);
+    if(binding != localtable.end())
+        return binding->second;
+
+    if(global != nullptr)
+        return global;
+
+    throw EvalError(1, node->content, nullptr);
+}
+
 TreeNode* atom(TreeNode* node){
     if(node->atomtype == tokentype::SYMBOL || node->atomtype == tokentype::QUOTE || node->atomtype == tokentype::ATOM){
-        if(localtable.find(node->content) != localtable.end()){
-            return localtable[node->content];
-        }
-        
-        if(definetable.find(node->content) != definetable.end()){
-            return definetable[node->content];
-        }
+        announceepoch();
+        const Binding* cached = node->binding.load();
+        while(cached != nullptr && cached->owner != session) cached = cached->next;
+        if(cached != nullptr && cached->version == session->envversion){
+            if(cached->local){
+                auto local = localtable.find(node->content);
+                if(local != localtable.end()) return local->second;
+            }
 
-        else if(checkpri(node) != nullptr){
-            return checkpri(node);            
+            if(cached->value != nullptr) return cached->value;
         }
 
-        else{
-            errortype = 1;
-            errorop = node->content;
-            evalerror = true;
-            return nullptr;
-        }
+        return lookup(node);
     }
         
     else return node;
 }
 
 TreeNode* quote(TreeNode* node){
-    if(node->right->type == nodetype::NIL || node->right->right->type != nodetype::NIL){
-        errortype = 2;
-        errorop = "quote";
-        evalerror = true;
-        toplevel--;
-        return nullptr;
-    }
+    if(node->right->type == nodetype::NIL || node->right->right->type != nodetype::NIL)
+        throw EvalError(2, "quote", nullptr);
         
     if(node->right->left->type == nodetype::ATOM && node->right->left->atomtype == tokentype::SYMBOL){
         node->right->left->atomtype = tokentype::ATOM;
     }
 
-    toplevel--;
     return node->right->left;
 }
 
+// The (begin ...) that runs a define or lambda body, built once per form.
+TreeNode* bodyexpr(TreeNode* form, TreeNode* bodylist){
+    TreeNode* expansion = form->expansion.load(memory_order_acquire);
+    if(expansion != nullptr) return expansion;
+
+    TreeNode* beginnode = new TreeNode("begin", tokentype::SYMBOL);
+    expansion = new TreeNode("(", beginnode, bodylist);
+    form->expansion.store(expansion, memory_order_release);
+    return expansion;
+}
+
 TreeNode* define(TreeNode* node){
-    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL){
-        errortype = 3;
-        evalerror = true;
-        evalerrortoken = copy(node);
-        toplevel--;
-        return nullptr;
-    }
+    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL)
+        throw EvalError(3, "", copy(node));
 
     TreeNode* target = node->right->left;
     if(target->type == nodetype::CONS){
         TreeNode* function = target->left;
-        if(function->atomtype != tokentype::SYMBOL || isreserved(function->content)){
-            errortype = 3;
-            evalerror = true;
-            evalerrortoken = copy(node);
-            toplevel--;
-            return nullptr;
-        }
+        if(function->atomtype != tokentype::SYMBOL || isreserved(function->content))
+            throw EvalError(3, "", copy(node));
 
         vector<string> parameters = {};
         TreeNode* paranode = target->right;
         while(paranode->type == nodetype::CONS){
-            if(paranode->left->atomtype != tokentype::SYMBOL){
-                errortype = 3;
-                evalerror = true;
-                evalerrortoken = copy(node);
-                toplevel--;
-                return nullptr;
-            }
+            if(paranode->left->atomtype != tokentype::SYMBOL)
+                throw EvalError(3, "", copy(node));
+
             parameters.push_back(paranode->left->content);
+            addlocalname(paranode->left->content);
             paranode = paranode->right;
         }
-        if(paranode->type != nodetype::NIL){
-            errortype = 3;
-            evalerror = true;
-            evalerrortoken = copy(node);
-            toplevel--;
-            return nullptr;
-        }
+        if(paranode->type != nodetype::NIL)
+            throw EvalError(3, "", copy(node));
 
-        TreeNode* bodylist = node->right->right;
-        TreeNode* beginnode = new TreeNode("begin", tokentype::SYMBOL);
-        TreeNode* beginexpr = new TreeNode("(", beginnode, bodylist);
+        TreeNode* beginexpr = bodyexpr(node, node->right->right);
 
         TreeNode* fn = new TreeNode("#<procedure " + function->content + ">", tokentype::SYMBOL);
-        definetable[function->content] = fn;
-        lambdatable[fn] = new UserFunction(parameters, beginexpr);
+        fn->function = new UserFunction(parameters, beginexpr);
+        {
+            unique_lock<shared_mutex> guard(session->envlock);
+            session->definetable[function->content] = fn;
+        }
+        session->envversion = ++versioncounter;
 
 
-        if(verbose) cout << endl << "> " << function->content << " defined" << endl;
+        if(session->verbose) *outstream << endl << "> " << function->content << " defined" << endl;
         needprint = false;
-        toplevel--;
         return target;;
     }
 
-    if(node->right->right->right->type != nodetype::NIL){
-        errortype = 3;
-        evalerror = true;
-        evalerrortoken = copy(node);
-        toplevel--;
-        return nullptr;
-    }
+    if(node->right->right->right->type != nodetype::NIL)
+        throw EvalError(3, "", copy(node));
         
     TreeNode* name = node->right->left;
-    if(name->atomtype != tokentype::SYMBOL || isreserved(name->content)){
-        errortype = 3;
-        evalerror = true;
-        evalerrortoken = copy(node);
-        toplevel--;
-        return nullptr;            
-    }
+    if(name->atomtype != tokentype::SYMBOL || isreserved(name->content))
+        throw EvalError(3, "", copy(node));
         
-    TreeNode* val = eval(node->right->right->left);
-    if(evalerror){
-        if(errortype == 7) errortype = 6;
-        toplevel--;
-        return nullptr;
+    TreeNode* val = nullptr;
+    try{
+        val = eval(node->right->right->left);
     }
+    catch(EvalError& error){
+        if(error.type == 7) error.type = 6;
+        throw;
+    }
+
+    unique_lock<shared_mutex> guard(session->envlock);
     if(node->right->right->left->left != nullptr && node->right->right->left->left->atomtype == tokentype::QUOTE){
-        definetable[name->content] = val;
+        session->definetable[name->content] = val;
     }
     else if(isreserved(val->content))
-        functionalias[name->content] = val->content;
+        session->functionalias[name->content] = val->content;
     else
-        definetable[name->content] = val;
+        session->definetable[name->content] = val;
 
-    if(verbose) cout << endl << "> " << name->content << " defined" << endl;
+    guard.unlock();
+    session->envversion = ++versioncounter;
+    if(session->verbose) *outstream << endl << "> " << name->content << " defined" << endl;
     needprint = false;
-    toplevel--;
     return name;    
 }
 
 TreeNode* cons(TreeNode* node){
-    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL || node->right->right->right->type != nodetype::NIL){
-        errortype = 2;
-        evalerror = true;
-        errorop = "cons";
-        toplevel--;
-        return nullptr;
-    }
+    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL || node->right->right->right->type != nodetype::NIL)
+        throw EvalError(2, "cons", nullptr);
     
-    TreeNode* left = eval(node->right->left);
-    if(evalerror){
-        if(errortype == 6) errortype = 7;
-        toplevel--;
-        return nullptr;
-    } 
-    TreeNode* right = eval(node->right->right->left);
-    if(evalerror){
-        if(errortype == 6) errortype = 7;
-        toplevel--;
-        return nullptr;       
-    } 
+    TreeNode* left = evalarg(node->right->left);
+    TreeNode* right = evalarg(node->right->right->left);
     
-    toplevel--;
     if(right->atomtype == tokentype::NIL)
         right = new TreeNode(nodetype::NIL);
     else if(right->content == "("){
@@ -924,81 +1557,48 @@ TreeNode* cons(TreeNode* node){
 }
 
 TreeNode* list(TreeNode* node){
-    if(node->right->type == nodetype::NIL){
-        toplevel--;
+    if(node->right->type == nodetype::NIL)
         return falsenode();
-    }
 
     TreeNode* result = new TreeNode(nodetype::NIL);
     TreeNode** tail = &result;
     
 
-    TreeNode* evaled = eval(node->right->left);
-    if(evalerror){
-        if(errortype == 6) errortype = 7;
-        toplevel--;
-        return nullptr;
-    } 
+    TreeNode* evaled = evalarg(node->right->left);
     *tail = new TreeNode("(", evaled, new TreeNode(nodetype::NIL));
 
     tail = &((*tail)->right);
     node = node->right->right;
     while(node->type != nodetype::NIL){
-        TreeNode* evaled = eval(node->left);
-        if(evalerror){
-            if(errortype == 6) errortype = 7;
-            toplevel--;
-            return nullptr;
-        }
-
+        TreeNode* evaled = evalarg(node->left);
         *tail = new TreeNode("", evaled, new TreeNode(nodetype::NIL));
         tail = &((*tail)->right);
         node = node->right;
     }
 
-    toplevel--;
     return result;
 }
 
 TreeNode* carcdr(const string& op, TreeNode* node){
-    if(node->right->type == nodetype::NIL || node->right->right->type != nodetype::NIL){
-        errortype = 2;
-        evalerror = true;
-        errorop = restorename(op);
-        toplevel--;
-        return nullptr;
-    }
+    if(node->right->type == nodetype::NIL || node->right->right->type != nodetype::NIL)
+        throw EvalError(2, restorename(op), nullptr);
 
-    TreeNode* target = eval(node->right->left);
-    if(evalerror){
-        if(errortype == 6) errortype = 7;
-        toplevel--;
-        return nullptr;        
-    } 
-    if(target->type != nodetype::CONS){
-        errorop = restorename(op);
-        errortype = 5;
-        evalerrortoken = copy(target);
-        evalerror = true;
-        toplevel--;
-        return nullptr;
-    }
+    TreeNode* target = evalarg(node->right->left);
+    if(target->type != nodetype::CONS)
+        throw EvalError(5, restorename(op), copy(target));
 
     if(op == "car" || op == "#<procedure car>"){
         if(target->left->type == nodetype::ATOM && target->left->atomtype == tokentype::SYMBOL){
             TreeNode* temp = copy(target->left);
             temp->atomtype = tokentype::ATOM;
-            toplevel--;
             return temp;
         }
 
-        toplevel--;
         return target->left;
     }
 
     else{ 
         TreeNode* cdrresult = target->right;
-        toplevel--;
         if(cdrresult->type == nodetype::NIL)
             return new TreeNode("nil", tokentype::NIL);
         else if(cdrresult->type == nodetype::CONS) 
@@ -1008,50 +1608,41 @@ TreeNode* carcdr(const string& op, TreeNode* node){
     }
 }
 
-TreeNode* begin(TreeNode* node){
-    if(node->right->type == nodetype::NIL){
-        errortype = 2;
-        evalerror = true;
-        errorop = "begin";
-        toplevel--;
+// Evaluates node, treating "no return value" as nullptr instead of an error;
+// begin and the leading actions of a cond clause discard such values.
+TreeNode* evalvalue(TreeNode* node){
+    try{
+        return eval(node);
+    }
+    catch(EvalError& error){
+        if(error.type != 6) throw;
         return nullptr;
     }
+}
+
+TreeNode* begin(TreeNode* node){
+    if(node->right->type == nodetype::NIL)
+        throw EvalError(2, "begin", nullptr);
 
     TreeNode* cur = node->right;
     TreeNode* result = nullptr;
 
     while(cur->type != nodetype::NIL){
-        result = eval(cur->left);
-        if(evalerror && errortype != 6) return nullptr;
-        evalerror = false;
+        result = evalvalue(cur->left);
         cur = cur->right;
     }
 
-    if(result == nullptr){
-        evalerror = true;
-        evalerrortoken = copy(node);
-        errortype = 6;
-    }
+    if(result == nullptr)
+        throw EvalError(6, "", copy(node));
 
-    if(result != nullptr) evalerror = false;
-    toplevel--;
     return result;
 }
 
 TreeNode* predicates(const string& op, TreeNode* node){
-    if(node->right->type == nodetype::NIL || node->right->right->type != nodetype::NIL){
-        errortype = 2;
-        evalerror = true;
-        errorop = restorename(op);
-        return nullptr;
-    }
+    if(node->right->type == nodetype::NIL || node->right->right->type != nodetype::NIL)
+        throw EvalError(2, restorename(op), nullptr);
 
-    TreeNode* target = eval(node->right->left);
-    toplevel--;
-    if(evalerror){
-        if(errortype == 6) errortype = 7;
-        return nullptr;        
-    } 
+    TreeNode* target = evalarg(node->right->left);
 
     if(op == "atom?" || op == "#<procedure atom?>"){
         if((target->type == nodetype::ATOM  && target->atomtype != tokentype::SYMBOL ) || target->type == nodetype::NIL || isreserved(node->right->left->content))
@@ -1128,114 +1719,154 @@ TreeNode* predicates(const string& op, TreeNode* node){
             return falsenode();
     }
 
-    toplevel--;
     return falsenode();  
 }
 
-TreeNode* arithmetic(const string& op, TreeNode* node){
-    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL){
-        errortype = 2;
-        evalerror = true;
-        errorop = restorename(op);
-        toplevel--;
-        return nullptr;
-    }
-
-    int lprint = 0;
+struct Accumulator{
     bool usefloat = false;
     bool firstnum = true;
-    float floatresult = (op == "*" || op == "/" || op == "#<procedure *>" || op == "#<procedure />") ? 1.0f : 0.0f;
-    int intresult = (op == "*" || op == "/" || op == "#<procedure *>" || op == "#<procedure />") ? 1 : 0;
-    for(TreeNode* cur = node->right; cur->type != nodetype::NIL; cur = cur->right){
-        TreeNode* left = eval(cur->left);
-        if(evalerror){
-            if(errortype == 6) errortype = 7;
-            toplevel--;
-            return nullptr;             
+    float floatresult = 0;
+    int intresult = 0;
+};
+
+void accumulate(const string& op, Accumulator& acc, TreeNode* left){
+    if(left->atomtype != tokentype::FLOAT && left->atomtype != tokentype::INT)
+        throw EvalError(5, restorename(op), copy(left));
+    
+    Numbertype num = stringtrans(left);
+    if(num.isFloat) acc.usefloat = true;
+    float value = num.isFloat ? num.floatValue : (float)num.intValue;
+
+    if(acc.firstnum){
+        acc.floatresult = value;
+        acc.intresult = num.isFloat ? (int)value : num.intValue;
+        acc.firstnum = false;
+    }
+    
+    else{
+        if(op == "+" || op == "#<procedure +>"){
+            acc.floatresult += value;
+            acc.intresult += num.isFloat ? (int)value : num.intValue;
         }
         
-        if(left->atomtype != tokentype::FLOAT && left->atomtype != tokentype::INT){
-            errorop = restorename(op);
-            errortype = 5;
-            evalerrortoken = copy(left);
-            evalerror = true;
-            toplevel--;
-            return nullptr;
+        else if(op == "-" || op == "#<procedure ->"){
+            acc.floatresult -= value;
+            acc.intresult -= num.isFloat ? (int)value : num.intValue;
         }
-        
-        Numbertype num = stringtrans(left);
-        if(num.isFloat) usefloat = true;
-        float value = num.isFloat ? num.floatValue : (float)num.intValue;
-
-        if(firstnum){
-            floatresult = value;
-            intresult = num.isFloat ? (int)value : num.intValue;
-            firstnum = false;
+        else if(op == "*" || op == "#<procedure *>"){
+            acc.floatresult *= value;
+            acc.intresult *= num.isFloat ? (int)value : num.intValue;
         }
-        
-        else{
-            if(op == "+" || op == "#<procedure +>"){
-                floatresult += value;
-                intresult += num.isFloat ? (int)value : num.intValue;
-            }
+        else if(op == "/" || op == "#<procedure />"){
+            if(value == 0 && num.intValue == 0)
+                throw EvalError(11, "/", nullptr);
             
-            else if(op == "-" || op == "#<procedure ->"){
-                floatresult -= value;
-                intresult -= num.isFloat ? (int)value : num.intValue;
+            if(acc.usefloat)
+                acc.floatresult /= value;
+            else
+                acc.intresult /= num.isFloat ? (int)value : num.intValue;
+        }
+    }
+}
+
+// Fast path for a call site whose operands have so far all been INT, or all
+// numbers with at least one FLOAT. It keeps only the accumulator that decides
+// the result. Returns nullptr as soon as an operand breaks that assumption;
+// the operands evaluated so far are left in seen and cur points past them.
+TreeNode* specarithmetic(char op, spectype spec, TreeNode** seen, int& count, TreeNode*& cur){
+    int intresult = 0;
+    float floatresult = 0;
+    bool anyfloat = false;
+    for(; cur->type != nodetype::NIL; cur = cur->right){
+        if(count == specwidth) return nullptr;
+
+        TreeNode* value = evalarg(cur->left);
+        seen[count++] = value;
+        if(spec == spectype::INT){
+            if(value->atomtype != tokentype::INT){
+                cur = cur->right;
+                return nullptr;
+            }
+
+            int number = parseint(value->content);
+            if(count == 1) intresult = number;
+            else if(op == '+') intresult += number;
+            else if(op == '-') intresult -= number;
+            else if(op == '*') intresult *= number;
+            else{
+                if(number == 0) throw EvalError(11, "/", nullptr);
+                intresult /= number;
             }
-            else if(op == "*" || op == "#<procedure *>"){
-                floatresult *= value;
-                intresult *= num.isFloat ? (int)value : num.intValue;
+        }
+
+        else{
+            if(value->atomtype != tokentype::INT && value->atomtype != tokentype::FLOAT){
+                cur = cur->right;
+                return nullptr;
             }
-            else if(op == "/" || op == "#<procedure />"){
-                if(value == 0 && num.intValue == 0){
-                    evalerror = true;
-                    cout << endl << "> ERROR (division by zero) : /" << endl;
-                    toplevel--;
-                    return nullptr;
-                }
-                
-                if(usefloat)
-                    floatresult /= value;
-                else
-                    intresult /= num.isFloat ? (int)value : num.intValue;
+
+            if(value->atomtype == tokentype::FLOAT) anyfloat = true;
+            float number = value->atomtype == tokentype::FLOAT ? parsefloat(value->content) : (float)parseint(value->content);
+            if(count == 1) floatresult = number;
+            else if(op == '+') floatresult += number;
+            else if(op == '-') floatresult -= number;
+            else if(op == '*') floatresult *= number;
+            else{
+                if(number == 0) throw EvalError(11, "/", nullptr);
+                // an integer prefix divides the integer accumulator only
+                if(anyfloat) floatresult /= number;
             }
         }
     }
 
-    toplevel--;
-    if(usefloat)
-        return makenumnode(true, floatresult, 0);
+    if(spec == spectype::INT) return makenumnode(false, 0.0f, intresult);
+    if(!anyfloat) return nullptr;
+    return makenumnode(true, floatresult, 0);
+}
+
+TreeNode* arithmetic(const string& op, TreeNode* node){
+    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL)
+        throw EvalError(2, restorename(op), nullptr);
+
+    Accumulator acc;
+    TreeNode* seen[specwidth];
+    int count = 0;
+    TreeNode* cur = node->right;
+    spectype spec = node->spec.load(memory_order_relaxed);
+    if(spec == spectype::INT || spec == spectype::FLOAT){
+        TreeNode* result = specarithmetic(op.size() == 1 ? op[0] : op[12], spec, seen, count, cur);
+        if(result != nullptr) return result;
+
+        node->spec.store(spectype::GENERIC, memory_order_relaxed);
+        for(int i = 0; i < count; i++) accumulate(op, acc, seen[i]);
+    }
+
+    bool allint = true;
+    for(; cur->type != nodetype::NIL; cur = cur->right){
+        TreeNode* left = evalarg(cur->left);
+        accumulate(op, acc, left);
+        if(left->atomtype != tokentype::INT) allint = false;
+        count++;
+    }
+
+    if(spec == spectype::NONE)
+        node->spec.store(count > specwidth ? spectype::GENERIC : allint ? spectype::INT : spectype::FLOAT, memory_order_relaxed);
+
+    if(acc.usefloat)
+        return makenumnode(true, acc.floatresult, 0);
     else
-        return makenumnode(false, 0.0f, intresult);
+        return makenumnode(false, 0.0f, acc.intresult);
 }
 
 TreeNode* logic(const string& op, TreeNode* node){
-    if(node->right->type == nodetype::NIL){
-        errortype = 2;
-        evalerror = true;
-        errorop = restorename(op);
-        toplevel--;
-        return nullptr;
-    }
+    if(node->right->type == nodetype::NIL)
+        throw EvalError(2, restorename(op), nullptr);
     
     if(op == "not" || op == "#<procedure not>"){
-        if(node->right->right->type != nodetype::NIL){
-            errortype = 2;
-            evalerror = true;
-            errorop = restorename(op);
-            toplevel--;
-            return nullptr;
-        }
-
-        TreeNode* target = eval(node->right->left);
-        if(evalerror){
-            if(errortype == 6) errortype = 7;
-            toplevel--;
-            return nullptr;             
-        } 
+        if(node->right->right->type != nodetype::NIL)
+            throw EvalError(2, restorename(op), nullptr);
 
-        toplevel--;
+        TreeNode* target = evalarg(node->right->left);
         if(target->atomtype == tokentype::NIL)
             return truenode();
         else
@@ -1243,141 +1874,72 @@ TreeNode* logic(const string& op, TreeNode* node){
     }
 
     if(op == "and" || op == "#<procedure and>"){
-        if(node->right->right->type == nodetype::NIL){
-            errortype = 2;
-            evalerror = true;
-            errorop = restorename(op);
-            toplevel--;
-            return nullptr;
-        }
+        if(node->right->right->type == nodetype::NIL)
+            throw EvalError(2, restorename(op), nullptr);
 
         TreeNode* cur = node->right;
         TreeNode* result = nullptr;
         while(cur->type != nodetype::NIL){
-            result = eval(cur->left);
-            if(evalerror){
-                if(errortype == 6) errortype = 9;
-                toplevel--;
-                return nullptr;         
-            }
-
-            if(result->atomtype == tokentype::NIL){
-                toplevel--;
+            result = evalarg(cur->left, 9);
+            if(result->atomtype == tokentype::NIL)
                 return falsenode();
-            }
 
             cur = cur->right;
         }
 
-        toplevel--;
         return result == nullptr ? truenode() : result;
     }
 
     if(op == "or" || op == "#<procedure or>"){
-        if(node->right->right->type == nodetype::NIL){
-            errortype = 2;
-            evalerror = true;
-            errorop = restorename(op);
-            toplevel--;
-            return nullptr;
-        }
+        if(node->right->right->type == nodetype::NIL)
+            throw EvalError(2, restorename(op), nullptr);
 
         TreeNode* cur = node->right;
         while(cur->type != nodetype::NIL){
-            TreeNode* result = eval(cur->left);
-            if(evalerror){
-                if(errortype == 6) errortype = 9;
-                toplevel--;
-                return nullptr;         
-            }
-
-            if(result->content != "nil" && result->content != "#f"){
-                toplevel--;
+            TreeNode* result = evalarg(cur->left, 9);
+            if(result->content != "nil" && result->content != "#f")
                 return result;
-            }
 
             cur = cur->right;
         }
         
-        toplevel--;
         return falsenode();
     }
 
-    toplevel--;
     return nullptr;
 }
 
 TreeNode* evalstring(const string& op, TreeNode* node){
     TreeNode* ans = truenode();
-    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL){
-        errortype = 2;
-        evalerror = true;
-        errorop = restorename(op);
-        toplevel--;
-        return nullptr;
-    }
+    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL)
+        throw EvalError(2, restorename(op), nullptr);
 
     if(op == "string-append" || op == "#<procedure string-append>"){
         string result = "";
         TreeNode* cur = node->right;
         while(cur->type != nodetype::NIL) {
-            TreeNode* target = eval(cur->left);
-            if(evalerror){
-                if(errortype == 6) errortype = 7;
-                toplevel--;
-                return nullptr;         
-            }
-
-            if(target->atomtype != tokentype::STRING){
-                errorop = restorename(op);
-                errortype = 5;
-                evalerrortoken = copy(target);
-                evalerror = true;
-                toplevel--;
-                return nullptr;
-            }
+            TreeNode* target = evalarg(cur->left);
+            if(target->atomtype != tokentype::STRING)
+                throw EvalError(5, restorename(op), copy(target));
 
             result += target->content.substr(1, target->content.length() - 2);  
             cur = cur->right;
         }
 
-        toplevel--;
         return new TreeNode("\"" + result + "\"", tokentype::STRING);
     }
 
     else{
         TreeNode* cur = node->right;
-        TreeNode* prev = eval(cur->left);
-        if(evalerror){
-            if(errortype == 6) errortype = 7;
-            toplevel--;
-            return nullptr;         
-        }
-        if(prev->atomtype != tokentype::STRING){
-            errorop = restorename(op);
-            errortype = 5;
-            evalerrortoken = copy(prev);
-            toplevel--;
-            evalerror = true;
-            return nullptr;
-        }
+        TreeNode* prev = evalarg(cur->left);
+        if(prev->atomtype != tokentype::STRING)
+            throw EvalError(5, restorename(op), copy(prev));
 
         cur = cur->right;        
         while(cur->type != nodetype::NIL){
-            TreeNode* next = eval(cur->left);
-            if(evalerror){
-                if(errortype == 6) errortype = 7;
-                toplevel--;
-                return nullptr;         
-            }
-            if(next->atomtype != tokentype::STRING){
-                errorop = restorename(op);
-                errortype = 5;
-                evalerrortoken = copy(next);
-                toplevel--;
-                evalerror = true;
-                return nullptr;
-            }
+            TreeNode* next = evalarg(cur->left);
+            if(next->atomtype != tokentype::STRING)
+                throw EvalError(5, restorename(op), copy(next));
 
             if(op == "string>?" || op == "#<procedure string>?>"){
                 if(prev->content.substr(1, prev->content.length() - 2) <= next->content.substr(1, next->content.length() - 2))
@@ -1398,117 +1960,86 @@ TreeNode* evalstring(const string& op, TreeNode* node){
             cur = cur->right;
         }
 
-        toplevel--;
         return ans;
     }
+}
 
-    evalerror = true;
-    cout << endl << "> ERROR (unknown string operator) : " << op << endl;
-    toplevel--;
-    return nullptr;
+enum class relationtype{ LT, LE, EQ, GT, GE };
+
+relationtype relationof(const string& relation){
+    if(relation == "<") return relationtype::LT;
+    if(relation == "<=") return relationtype::LE;
+    if(relation == "=") return relationtype::EQ;
+    if(relation == ">") return relationtype::GT;
+    return relationtype::GE;
 }
 
-TreeNode* compare(const string& op, TreeNode* node){
-    TreeNode* ans = truenode();
-    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL){
-        errortype = 2;
-        evalerror = true;
-        errorop = restorename(op);
-        toplevel--;
-        return nullptr;
+template<typename T> bool related(relationtype relation, T prev, T next){
+    switch(relation){
+        case relationtype::LT: return prev < next;
+        case relationtype::LE: return prev <= next;
+        case relationtype::EQ: return prev == next;
+        case relationtype::GT: return prev > next;
+        default: return prev >= next;
     }
+}
 
-    TreeNode* cur = node->right;
-    TreeNode* prevNode = eval(cur->left);
-    if(evalerror){
-        if(errortype == 6) errortype = 7;
-        toplevel--;
-        return nullptr;         
-    }
-    if(prevNode->atomtype != tokentype::INT && prevNode->atomtype != tokentype::FLOAT){
-        errorop = restorename(op);
-        errortype = 5;
-        evalerrortoken = copy(prevNode);
-
-        evalerror = true;
-        toplevel--;
-        return nullptr;
-    }
+bool exactfloat(int value){
+    return value >= -(1 << 24) && value <= (1 << 24);
+}
 
-    Numbertype prevNum = stringtrans(prevNode);
-    cur = cur->right;
+TreeNode* compare(const string& op, TreeNode* node){
+    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL)
+        throw EvalError(2, restorename(op), nullptr);
+
+    relationtype relation = relationof(restorename(op));
+    spectype spec = node->spec.load(memory_order_relaxed);
+    bool ans = true, allint = true;
+    int prevInt = 0;
+    float prevVal = 0;
+    for(TreeNode* cur = node->right; cur->type != nodetype::NIL; cur = cur->right){
+        TreeNode* nextNode = evalarg(cur->left);
+        if(spec == spectype::INT && nextNode->atomtype == tokentype::INT){
+            // ints that floats represent exactly compare the same either way
+            int nextInt = parseint(nextNode->content);
+            if(cur != node->right){
+                bool holds = exactfloat(prevInt) && exactfloat(nextInt) ? related(relation, prevInt, nextInt)
+                                                                        : related(relation, (float)prevInt, (float)nextInt);
+                if(!holds) ans = false;
+            }
 
-    while(cur->type != nodetype::NIL){
-        TreeNode* nextNode = eval(cur->left);
-        if(evalerror){
-            if(errortype == 6) errortype = 7;
-            toplevel--;
-            return nullptr;         
+            prevInt = nextInt;
+            continue;
         }
-        if(nextNode->atomtype != tokentype::INT && nextNode->atomtype != tokentype::FLOAT){
-            errorop = restorename(op);
-            errortype = 5;
-            evalerrortoken = copy(nextNode);
 
-            evalerror = true;
-            toplevel--;
-            return nullptr;
+        if(spec == spectype::INT){
+            node->spec.store(spectype::GENERIC, memory_order_relaxed);
+            spec = spectype::GENERIC;
+            prevVal = (float)prevInt;
         }
 
-        Numbertype nextNum = stringtrans(nextNode);
+        if(nextNode->atomtype != tokentype::INT && nextNode->atomtype != tokentype::FLOAT)
+            throw EvalError(5, restorename(op), copy(nextNode));
 
-        float prevVal = prevNum.isFloat ? prevNum.floatValue : static_cast<float>(prevNum.intValue);
+        if(nextNode->atomtype != tokentype::INT) allint = false;
+        Numbertype nextNum = stringtrans(nextNode);
         float nextVal = nextNum.isFloat ? nextNum.floatValue : static_cast<float>(nextNum.intValue);
-
-        if(op == "<" || op == "#<procedure <>"){
-            if(!(prevVal < nextVal)) ans = falsenode();
-        }
-        
-        else if(op == "<=" || op == "#<procedure <=>"){
-            if(!(prevVal <= nextVal)) ans = falsenode();
-        }
-        
-        else if(op == "=" || op == "#<procedure =>"){
-            if(prevVal != nextVal) ans = falsenode();
-        }
-        
-        else if(op == ">" || op == "#<procedure >>"){
-            if(!(prevVal > nextVal)) ans = falsenode();
-        }
-        
-        else if(op == ">=" || op == "#<procedure >=>"){
-            if(!(prevVal >= nextVal)) ans = falsenode();
-        }
-        
-        prevNum = nextNum;
-        cur = cur->right;
+        if(cur != node->right && !related(relation, prevVal, nextVal)) ans = false;
+        prevVal = nextVal;
     }
 
-    toplevel--;
-    return ans;
+    if(spec == spectype::NONE)
+        node->spec.store(allint ? spectype::INT : spectype::GENERIC, memory_order_relaxed);
+
+    return ans ? truenode() : falsenode();
 }
 
 TreeNode* eqv(TreeNode* node){
-    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL || node->right->right->right->type != nodetype::NIL){
-        errortype = 2;
-        evalerror = true;
-        errorop = "eqv?";
-        toplevel--;
-        return nullptr;
-    }
+    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL || node->right->right->right->type != nodetype::NIL)
+        throw EvalError(2, "eqv?", nullptr);
 
-    TreeNode* left = eval(node->right->left);
-    if(evalerror){
-        if(errortype == 6) errortype = 7;
-        toplevel--;
-        return nullptr;         
-    }
-    TreeNode* right = eval(node->right->right->left);
-    if(evalerror){
-        if(errortype == 6) errortype = 7;
-        toplevel--;
-        return nullptr;         
-    }
+    TreeNode* left = evalarg(node->right->left);
+    TreeNode* right = evalarg(node->right->right->left);
 
     bool result = false;
 
@@ -1525,7 +2056,6 @@ TreeNode* eqv(TreeNode* node){
         result = (left == right);
     }
 
-    toplevel--;
     return result ? truenode() : falsenode();
 }
 
@@ -1544,461 +2074,2150 @@ bool equalrec(TreeNode* a, TreeNode* b){
 }
 
 TreeNode* equal(TreeNode* node){
-    evalerrortoken = copy(node);
-    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL || node->right->right->right->type != nodetype::NIL){
-        errortype = 2;
-        evalerror = true;
-        errorop = "equal?";   
-        toplevel--;
-        return nullptr;
-    }
+    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL || node->right->right->right->type != nodetype::NIL)
+        throw EvalError(2, "equal?", nullptr);
 
-    TreeNode* left = eval(node->right->left);
-    if(evalerror){
-        if(errortype == 6) errortype = 7;
-        toplevel--;
-        return nullptr;         
-    }
-    TreeNode* right = eval(node->right->right->left);
-    if(evalerror){
-        if(errortype == 6) errortype = 7;
-        toplevel--;
-        return nullptr;         
-    }
+    TreeNode* left = evalarg(node->right->left);
+    TreeNode* right = evalarg(node->right->right->left);
 
     bool result = equalrec(left, right);
 
-    toplevel--;
     return result ? truenode() : falsenode();
 }
 
-TreeNode* evalif(TreeNode* node){  
-    int lprint = 0, para = 0;
-    TreeNode* temp = node;
-    while(temp->type != nodetype::ATOM && temp->type != nodetype::NIL){
-        para++;
-        temp = temp->right;
-    }
-    
-    TreeNode* result = nullptr;
-    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL || para > 4 || para < 3){
-        evalerror = true;
-        errortype = 2;
-        errorop = "if";
-        toplevel--;
-        return nullptr;
-    }
+// Picks the branch of an if to evaluate next.
+TreeNode* ifbranch(TreeNode* node){  
+    if(!ischecked(node, checkedif)){
+        int para = 0;
+        TreeNode* temp = node;
+        while(temp->type != nodetype::ATOM && temp->type != nodetype::NIL){
+            para++;
+            temp = temp->right;
+        }
 
-    TreeNode* test = eval(node->right->left);
-    if(evalerror){
-        if(errortype == 6) errortype = 8;
-        toplevel--;
-        return nullptr;         
+        if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL || para > 4 || para < 3)
+            throw EvalError(2, "if", nullptr);
+        markchecked(node, checkedif);
     }
 
-    if(test->atomtype != tokentype::NIL){
-        result = eval(node->right->right->left);
-        if(evalerror) return nullptr;
-        toplevel--;
-        return result;
-    } 
+    TreeNode* test = evalarg(node->right->left, 8);
+
+    if(test->atomtype != tokentype::NIL)
+        return node->right->right->left;
     else if(node->right->right->right->type != nodetype::NIL){
-        toplevel--;
-        return eval(node->right->right->right->left);
-    }
-    else{
-        errortype = 6;
-        evalerrortoken = copy(node);
-        evalerror = true;    
+        // the else branch of a top-level if may still define, as it always could
+        if(rootform == node) rootform = node->right->right->right->left;
+        return node->right->right->right->left;
     }
 
-    toplevel--;
-    return nullptr;
-
+    throw EvalError(6, "", copy(node));
 }
 
-TreeNode* condition(TreeNode* node){
-    int lprint = 0;
+TreeNode* evalif(TreeNode* node){
+    return eval(ifbranch(node));
+}
 
-    if(node->right->type == nodetype::NIL){
-        evalerror = true;
-        errortype = 3;
-        evalerrortoken = copy(node);
-        toplevel--;
-        return nullptr;
+TreeNode* actions(TreeNode* actionlist){
+    while(actionlist->right->type != nodetype::NIL){
+        evalvalue(actionlist->left);
+        actionlist = actionlist->right;
     }
 
+    return eval(actionlist->left);
+}
+
+// Picks the actions of the cond clause that applies.
+TreeNode* condclause(TreeNode* node){
     TreeNode* clause = node->right;
 
-    for(TreeNode* temp = clause; temp->type != nodetype::NIL; temp = temp->right){
-        TreeNode* currentclause = temp->left;
+    if(!ischecked(node, checkedcond)){
+        if(clause->type == nodetype::NIL)
+            throw EvalError(3, "", copy(node));
 
-        if(currentclause->type != nodetype::CONS){
-            evalerror = true;
-            errortype = 3;
-            evalerrortoken = copy(node);
-            toplevel--;
-            return nullptr;
-        }
+        for(TreeNode* temp = clause; temp->type != nodetype::NIL; temp = temp->right){
+            TreeNode* currentclause = temp->left;
 
-        if(currentclause->right->type == nodetype::NIL || currentclause->right->type == nodetype::ATOM){
-            evalerror = true;
-            errortype = 3;
-            evalerrortoken = copy(node);
-            toplevel--;
-            return nullptr;
-        }
+            if(currentclause->type != nodetype::CONS)
+                throw EvalError(3, "", copy(node));
 
-        nonlist(currentclause, 0);
-        if(errortype == 4){
-            evalerrortoken = copy(node);
-            evalerror = true;
-            toplevel--;
-            return nullptr;
+            if(currentclause->right->type == nodetype::NIL || currentclause->right->type == nodetype::ATOM)
+                throw EvalError(3, "", copy(node));
+
+            if(!islist(currentclause))
+                throw EvalError(4, "", copy(node));
         }
+        markchecked(node, checkedcond);
     }
 
     TreeNode* temp = clause;
-    int totalclauses = 0;
-
-    for(TreeNode* t = clause; t->type != nodetype::NIL; t = t->right)
-        totalclauses++;
-
-    int currentindex = 0;
-
     while(temp->type != nodetype::NIL){
-        currentindex++;
         TreeNode* currentclause = temp->left;
 
         TreeNode* test = currentclause->left;
-        bool islast = (currentindex == totalclauses);
+        bool islast = (temp->right->type == nodetype::NIL);
         bool iselse = (test->type == nodetype::ATOM && test->atomtype == tokentype::SYMBOL && test->content == "else");
 
-        if(iselse && islast){
-            TreeNode* actionlist = currentclause->right;
-            while(actionlist->right->type != nodetype::NIL){
-                TreeNode* dummy = eval(actionlist->left);
-                if(evalerror && errortype != 6){
-                    toplevel--;
-                    return nullptr;
-                } 
-                evalerror = false;
-                actionlist = actionlist->right;
-            }
-
-            TreeNode* result = eval(actionlist->left);
-            if(result != nullptr) evalerror = false;
-            toplevel--;
-            return result;
-        }
-
-        TreeNode* testresult = eval(test);
-        if(evalerror){
-            if(errortype == 6) errortype = 8;
-            toplevel--;
-            return nullptr;
-        } 
-
-        if(testresult->atomtype != tokentype::NIL){
-            TreeNode* actionlist = currentclause->right;
-            while(actionlist->right->type != nodetype::NIL){
-                TreeNode* dummy = eval(actionlist->left);
-                if(evalerror && errortype != 6){
-                    toplevel--;
-                    return nullptr;
-                }
-                evalerror = false;
-                actionlist = actionlist->right;
-            }
+        if(iselse && islast)
+            return currentclause->right;
 
-            TreeNode* result = eval(actionlist->left);
-            if(result != nullptr) evalerror = false;
-            toplevel--;
-            return result;
-        }
+        TreeNode* testresult = evalarg(test, 8);
+        if(testresult->atomtype != tokentype::NIL)
+            return currentclause->right;
 
         temp = temp->right;
     }
 
-    evalerror = true;
-    errortype = 6;
-    evalerrortoken = copy(node);
-    toplevel--;
-    return nullptr;
+    throw EvalError(6, "", copy(node));
 }
 
-TreeNode* userfunc(TreeNode* node, bool islet = false){
-    int argsize = 0;
-    TreeNode* func = eval(node->left);
-    TreeNode* temp = copy(node);
-    temp->left = func; 
-    UserFunction* fn = lambdatable[temp->left];
-    vector<string>& para = fn->parameters;
-    TreeNode* arg = temp->right;
+TreeNode* condition(TreeNode* node){
+    return actions(condclause(node));
+}
 
-    vector<TreeNode*> arglist;
-    TreeNode* walker = arg;
-    TreeNode* count = arg;
-    while(count->type == nodetype::CONS){
-        argsize++;
-        count = count->right;
-    }
+// Tiered JIT: once a user function has been called jitthreshold times it is
+// compiled to x86-64 if its body only uses integer parameters and constants,
+// arithmetic, comparison, if, cond, begin and calls to itself. The native code
+// has no side effects, so whenever it meets something it cannot handle (a
+// division by zero, an if without else that fails, ...) it bails out and the
+// call is simply run again by the interpreter, which reports the error.
+const int jitthreshold = 100;
+const int jitbaillimit = 8;
+
+struct JitCode{
+    void* entry;
+    size_t size;  // of the mapping entry starts
+    atomic<Session*> owner;
+    atomic<int> version;
+    vector<pair<string, string>> assumptions;  // operator symbol -> what it resolved to
+
+    JitCode(void* e, size_t s, Session* o, int v, vector<pair<string, string>> a) : entry(e), size(s), owner(o), version(v), assumptions(a) {}
+};
 
-    if(argsize != para.size()){
-        errortype = 2;
-        evalerror = true;
-        errorop = restorename(temp->left->content);
-        toplevel--;
-        return nullptr;
-    }
+void releasecode(void* item){
+    JitCode* code = (JitCode*)item;
+    munmap(code->entry, code->size);
+    delete code;
+}
 
-    while(walker->type == nodetype::CONS){
-        TreeNode* val = eval(walker->left);
-        if(evalerror){
-            if(errortype == 6 && !islet) errortype = 7;
-            if(errortype == 6 && islet){
-                errortype = 10;
-                evalerrortoken = copy(walker->left);
-            }
-            toplevel--;
-            return nullptr;
-        }
-        arglist.push_back(val);
-        walker = walker->right;
-    }
+mutex jitlock;
+thread_local jmp_buf* jitframe = nullptr;
 
-    map<string, TreeNode*> origintable = localtable;
-    if(!islet) localtable.clear();
-    for(int i = 0; i < para.size(); ++i)
-        localtable[para[i]] = arglist[i];
+[[noreturn]] void jitbail(){
+    longjmp(*jitframe, 1);
+}
 
-    TreeNode* result = eval(fn->body); 
-    if(evalerror && errortype == 6){
-        evalerrortoken = copy(node);
-        evalerrortoken->left->content = restorename(evalerrortoken->left->content);
-    } 
+bool jitint(TreeNode* node, int& value){
+    if(node->type != nodetype::ATOM || node->atomtype != tokentype::INT) return false;
 
-    localtable = origintable;
+    const string& text = node->content;
+    auto parsed = from_chars(text.data(), text.data() + text.size(), value);
+    if(parsed.ec != errc() || parsed.ptr != text.data() + text.size()) return false;
 
-    if(result != nullptr) evalerror = false;
-    toplevel--;
-    return result;
+    return inttext(value) == text;
 }
 
-TreeNode* lambda(TreeNode* node){
-    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL){
-        errortype = 3;
-        evalerror = true;
-        evalerrortoken = copy(node);
-        toplevel--;
-        return nullptr;
-    }
+// Procedures carry their body, so applying one needs no lookup.
+UserFunction* findfunction(TreeNode* label){
+    return label->function.load(memory_order_acquire);
+}
 
-    TreeNode* arglist = node->right->left;
-    TreeNode* bodylist = node->right->right;
+// "self" when the name calls a procedure running this very body, which every
+// procedure made by the same lambda form does.
+string jitresolve(const string& name, UserFunction* self){
+    TreeNode* def = definition(name);
+    if(def != nullptr) return findfunction(def) == self ? "self" : "";
+    if(isreserved(name)) return "#<procedure " + name + ">";
+
+    shared_lock<shared_mutex> guard(session->envlock);
+    auto alias = session->functionalias.find(name);
+    if(alias != session->functionalias.end()) return "#<procedure " + alias->second + ">";
+    return "";
+}
 
-    vector<string> para;
-    TreeNode* cur = arglist;
-    while(cur->type == nodetype::CONS){
-        if(cur->left->atomtype != tokentype::SYMBOL || isreserved(cur->left->content)){
-            errortype = 3;
-            evalerror = true;
-            evalerrortoken = copy(node);
-            toplevel--;
-            return nullptr;
-        }
-        para.push_back(cur->left->content);
-        cur = cur->right;
+#if defined(__x86_64__)
+
+struct JitCompiler{
+    enum Kind{ FAIL, INT, BOOL };
+
+    vector<uint8_t> code;
+    vector<string>& params;
+    UserFunction* self;
+    vector<pair<string, string>> assumptions;
+    vector<size_t> bails;
+
+    JitCompiler(vector<string>& p, UserFunction* s) : params(p), self(s) {}
+
+    void emit(initializer_list<uint8_t> bytes){
+        code.insert(code.end(), bytes);
     }
-    if(cur->type != nodetype::NIL && cur->atomtype != tokentype::NIL){
-        errortype = 3;
-        evalerror = true;
-        evalerrortoken = copy(node);
-        toplevel--;
-        return nullptr;
+
+    void emit32(int32_t value){
+        for(int i = 0; i < 4; i++) code.push_back((uint8_t)(value >> (8 * i)));
     }
 
-    if(bodylist->type != nodetype::CONS){
-        errortype = 3;
-        evalerror = true;
-        evalerrortoken = copy(node);
-        toplevel--;
-        return nullptr;
+    size_t jump(initializer_list<uint8_t> opcode){
+        emit(opcode);
+        emit32(0);
+        return code.size() - 4;
     }
 
-    TreeNode* beginnode = new TreeNode("begin", tokentype::SYMBOL);
-    TreeNode* beginexpr = new TreeNode("(", beginnode, bodylist);
+    void bind(size_t patch){
+        int32_t offset = (int32_t)(code.size() - (patch + 4));
+        memcpy(&code[patch], &offset, 4);
+    }
 
-    TreeNode* lambdalabel = new TreeNode("#<procedure lambda>", tokentype::SYMBOL);
-    lambdatable[lambdalabel] = new UserFunction(para, beginexpr);
+    void jumpbail(initializer_list<uint8_t> opcode){
+        bails.push_back(jump(opcode));
+    }
 
-    toplevel--;
-    return lambdalabel;
-}
+    int param(const string& name){
+        for(int i = 0; i < params.size(); i++)
+            if(params[i] == name) return i;
 
-TreeNode* let(TreeNode* node){
-    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL){
-        errortype = 3;
-        evalerror = true;
-        evalerrortoken = copy(node);
-        toplevel--;
-        return nullptr;
+        return -1;
     }
 
-    TreeNode* bindings = node->right->left; 
-    TreeNode* body = node->right->right;    
+    bool elements(TreeNode* node, vector<TreeNode*>& elems){
+        TreeNode* cur = node;
+        while(cur->type == nodetype::CONS){
+            elems.push_back(cur->left);
+            cur = cur->right;
+        }
 
-    vector<TreeNode*> paranames;
-    vector<TreeNode*> args;
+        return cur->type == nodetype::NIL;
+    }
 
-    TreeNode* cur = bindings;
-    while(cur->type == nodetype::CONS){
-        TreeNode* pair = cur->left;
+    string resolve(const string& name){
+        string resolved = jitresolve(name, self);
+        assumptions.push_back({ name, resolved });
+        return resolved;
+    }
 
-        if(pair->type != nodetype::CONS || pair->right->type != nodetype::CONS || pair->right->right->type != nodetype::NIL){
-            errortype = 3;
-            evalerror = true;
-            evalerrortoken = copy(node);
-            toplevel--;
-            return nullptr;
+    Kind atom(TreeNode* node){
+        int value = 0;
+        if(node->atomtype == tokentype::INT){
+            if(!jitint(node, value)) return FAIL;
+            emit({ 0xB8 });                                 // mov eax, imm32
+            emit32(value);
+            return INT;
         }
 
-        TreeNode* var = pair->left;
-        TreeNode* val = pair->right->left;
-
-        if(var->atomtype != tokentype::SYMBOL || isreserved(var->content)){
-            errortype = 3;
-            evalerror = true;
-            evalerrortoken = copy(node);
-            toplevel--;
-            return nullptr;
+        if(node->atomtype == tokentype::T){
+            emit({ 0xB8, 1, 0, 0, 0 });                     // mov eax, 1
+            return BOOL;
         }
 
-        paranames.push_back(var);
-        args.push_back(val);
+        if(node->atomtype == tokentype::NIL){
+            emit({ 0x31, 0xC0 });                           // xor eax, eax
+            return BOOL;
+        }
 
-        cur = cur->right;
+        int index = node->atomtype == tokentype::SYMBOL ? param(node->content) : -1;
+        if(index < 0) return FAIL;
+        emit({ 0x8B, 0x45, (uint8_t)(-4 * (index + 1)) });  // mov eax, [rbp - 4(i+1)]
+        return INT;
     }
 
-    if(cur->type != nodetype::NIL && cur->atomtype != tokentype::NIL){
-        errortype = 3;
-        evalerror = true;
-        evalerrortoken = copy(node);
-        toplevel--;
-        return nullptr;
+    // Evaluates a test and leaves 0 in eax when it is false.
+    bool test(TreeNode* node){
+        Kind kind = expr(node);
+        if(kind == FAIL) return false;
+        if(kind == INT) emit({ 0xB8, 1, 0, 0, 0 });
+        return true;
     }
 
-    TreeNode* paralist = makelist(paranames);
-    TreeNode* arglist = makelist(args);
-
-    TreeNode* beginnode = new TreeNode("begin", tokentype::SYMBOL);
-    TreeNode* beginexpr = new TreeNode("(", beginnode, body);
+    // Evaluates actions for effect and leaves the last one in eax.
+    bool sequence(vector<TreeNode*>& actions, size_t first){
+        for(size_t i = first; i + 1 < actions.size(); i++)
+            if(expr(actions[i]) == FAIL) return false;
 
-    TreeNode* lambdanode = new TreeNode("lambda", tokentype::SYMBOL);
-    TreeNode* lambdaexpr = new TreeNode("(", lambdanode, new TreeNode("(", paralist, beginexpr));
+        return expr(actions.back()) == INT;
+    }
 
-    TreeNode* letexpr = new TreeNode("(", lambdaexpr, arglist);
+    bool arithmetic(const string& op, vector<TreeNode*>& args){
+        if(expr(args[0]) != INT) return false;
+        emit({ 0x50 });                                     // push rax
+        for(size_t i = 1; i < args.size(); i++){
+            if(expr(args[i]) != INT) return false;
+            emit({ 0x89, 0xC1, 0x58 });                     // mov ecx, eax; pop rax
+            if(op == "#<procedure +>") emit({ 0x01, 0xC8 });
+            else if(op == "#<procedure ->") emit({ 0x29, 0xC8 });
+            else if(op == "#<procedure *>") emit({ 0x0F, 0xAF, 0xC1 });
+            else{
+                emit({ 0x85, 0xC9 });                       // test ecx, ecx
+                jumpbail({ 0x0F, 0x84 });
+                emit({ 0x83, 0xF9, 0xFF, 0x75, 0x0B });     // cmp ecx, -1; jne +11
+                emit({ 0x3D, 0, 0, 0, 0x80 });              // cmp eax, INT_MIN
+                jumpbail({ 0x0F, 0x84 });
+                emit({ 0x99, 0xF7, 0xF9 });                 // cdq; idiv ecx
+            }
+            emit({ 0x50 });
+        }
 
-    TreeNode* result = eval(letexpr, true);
-    if(evalerror && errortype == 6){
-        evalerrortoken = copy(node);  
+        emit({ 0x58 });
+        return true;
     }
 
-    toplevel--;
-    return result;
-}
+    // Integers are compared as floats, exactly like compare() does.
+    bool compare(const string& op, vector<TreeNode*>& args){
+        uint8_t setcc = op == "#<procedure <>" ? 0x92 : op == "#<procedure <=>" ? 0x96 : op == "#<procedure =>" ? 0x94
+                      : op == "#<procedure >>" ? 0x97 : 0x93;
+        if(expr(args[0]) != INT) return false;
+        emit({ 0x50, 0xB8, 1, 0, 0, 0, 0x50 });             // push prev; push 1
+        for(size_t i = 1; i < args.size(); i++){
+            if(expr(args[i]) != INT) return false;
+            emit({ 0x89, 0xC1 });                           // mov ecx, eax
+            emit({ 0x8B, 0x44, 0x24, 0x08 });               // mov eax, [rsp + 8]
+            emit({ 0xF3, 0x0F, 0x2A, 0xC0 });               // cvtsi2ss xmm0, eax
+            emit({ 0xF3, 0x0F, 0x2A, 0xC9 });               // cvtsi2ss xmm1, ecx
+            emit({ 0x0F, 0x2E, 0xC1 });                     // ucomiss xmm0, xmm1
+            emit({ 0x0F, setcc, 0xC2, 0x0F, 0xB6, 0xD2 });  // setcc dl; movzx edx, dl
+            emit({ 0x21, 0x14, 0x24 });                     // and [rsp], edx
+            emit({ 0x89, 0x4C, 0x24, 0x08 });               // mov [rsp + 8], ecx
+        }
 
-TreeNode* exit(TreeNode* node){
-    if(node->right->type != nodetype::NIL){
-        errortype = 2;
-        evalerror = true;
-        errorop = "exit";
-        return nullptr;
+        emit({ 0x58, 0x48, 0x83, 0xC4, 0x08 });             // pop rax; add rsp, 8
+        return true;
     }
 
-    return exitnode();
-}
+    bool call(vector<TreeNode*>& args){
+        static const initializer_list<uint8_t> pops[6] = {
+            { 0x5F }, { 0x5E }, { 0x5A }, { 0x59 }, { 0x41, 0x58 }, { 0x41, 0x59 }
+        };
 
-void clear(){
-    for(auto& pair : definetable){
-        if(pair.second != nullptr){
-            //delete pair.second;
-            pair.second = nullptr;
+        if(args.size() != params.size()) return false;
+        for(TreeNode* arg : args){
+            if(expr(arg) != INT) return false;
+            emit({ 0x50 });
         }
-    }
 
-    for(auto& pair : localtable){
-        if(pair.second != nullptr){
-            //delete pair.second;
-            pair.second = nullptr;
-        }
+        for(int i = (int)args.size() - 1; i >= 0; i--) emit(pops[i]);
+        int32_t offset = -(int32_t)(code.size() + 5);
+        emit({ 0xE8 });                                     // call the function itself
+        emit32(offset);
+        return true;
     }
 
-    for(auto& pair : lambdatable){
-        if(pair.second != nullptr){
-            //delete pair.second;
-            pair.second = nullptr;
-        }
+    bool evalif(vector<TreeNode*>& args){
+        if(args.size() != 2 && args.size() != 3) return false;
+        if(!test(args[0])) return false;
+
+        emit({ 0x85, 0xC0 });                               // test eax, eax
+        size_t otherwise = jump({ 0x0F, 0x84 });
+        if(expr(args[1]) != INT) return false;
+        size_t end = jump({ 0xE9 });
+        bind(otherwise);
+        if(args.size() == 2) jumpbail({ 0xE9 });
+        else if(expr(args[2]) != INT) return false;
+        bind(end);
+        return true;
     }
-    definetable.clear();
-    localtable.clear();
-    functionalias.clear();
-    lambdatable.clear();
-}
 
-TreeNode* eval(TreeNode* node, bool islet ){
-    if(node == nullptr) return nullptr;
+    bool condition(vector<TreeNode*>& clauses){
+        vector<size_t> ends;
+        if(clauses.empty()) return false;
 
-    if(node->type == nodetype::ATOM) return atom(node);
+        for(size_t i = 0; i < clauses.size(); i++){
+            vector<TreeNode*> clause;
+            if(!elements(clauses[i], clause) || clause.size() < 2) return false;
 
-    if(node->type == nodetype::CONS && node->left->atomtype == tokentype::SYMBOL && node->left->content == "lambda") {
-        toplevel++;
-        return lambda(node);
-    }
+            TreeNode* head = clause[0];
+            bool iselse = head->type == nodetype::ATOM && head->atomtype == tokentype::SYMBOL && head->content == "else";
+            if(iselse && i + 1 == clauses.size()){
+                if(!sequence(clause, 1)) return false;
+                ends.push_back(jump({ 0xE9 }));
+                break;
+            }
 
-    if(node->type == nodetype::CONS){
-        toplevel++;
-        if(node->left->type == nodetype::CONS && node->left->left->atomtype == tokentype::SYMBOL && node->left->left->content == "lambda") {
-            TreeNode* temp = copy(node);
-            TreeNode* built = lambda(node->left);
-            if(evalerror) return nullptr;
-            //node->left = built;
-            TreeNode* result = userfunc(node, islet);
-            if(evalerror && errortype == 6) evalerrortoken = copy(temp);
-            return result; 
+            if(!test(head)) return false;
+            emit({ 0x85, 0xC0 });
+            size_t next = jump({ 0x0F, 0x84 });
+            if(!sequence(clause, 1)) return false;
+            ends.push_back(jump({ 0xE9 }));
+            bind(next);
+            if(i + 1 == clauses.size()) jumpbail({ 0xE9 });
         }
 
-        TreeNode* funcNode = eval(node->left);
-        if(evalerror){
-            if(errortype == 6) errortype = 10;
-            return nullptr;
-        }
-        string op = funcNode->content;
-        nonlist(node, 0);
-        if(errortype == 4){
-            evalerror = true;
-            evalerrortoken = copy(node);
-            errorop = restorename(op);
-            return nullptr;
-        }
+        for(size_t end : ends) bind(end);
+        return true;
+    }
+
+    Kind expr(TreeNode* node){
+        if(node->type == nodetype::ATOM) return atom(node);
+        if(node->type != nodetype::CONS) return FAIL;
+
+        vector<TreeNode*> elems;
+        if(!elements(node, elems)) return FAIL;
+
+        TreeNode* head = elems[0];
+        if(head->type != nodetype::ATOM || head->atomtype != tokentype::SYMBOL || param(head->content) >= 0) return FAIL;
+
+        string op = resolve(head->content);
+        vector<TreeNode*> args(elems.begin() + 1, elems.end());
+        if(op == "self") return call(args) ? INT : FAIL;
+        if(isarithmetic(op)) return args.size() >= 2 && arithmetic(op, args) ? INT : FAIL;
+        if(iscompare(op)) return args.size() >= 2 && compare(op, args) ? BOOL : FAIL;
+        if(op == "#<procedure if>") return evalif(args) ? INT : FAIL;
+        if(op == "#<procedure cond>") return condition(args) ? INT : FAIL;
+        if(op == "#<procedure begin>") return !args.empty() && sequence(args, 0) ? INT : FAIL;
+        return FAIL;
+    }
+
+    bool function(TreeNode* body){
+        static const initializer_list<uint8_t> stores[6] = {
+            { 0x89, 0x7D, 0xFC }, { 0x89, 0x75, 0xF8 }, { 0x89, 0x55, 0xF4 },
+            { 0x89, 0x4D, 0xF0 }, { 0x44, 0x89, 0x45, 0xEC }, { 0x44, 0x89, 0x4D, 0xE8 }
+        };
+
+        if(params.size() > 6) return false;
+        emit({ 0x55, 0x48, 0x89, 0xE5, 0x48, 0x83, 0xEC, 0x20 });   // push rbp; mov rbp, rsp; sub rsp, 32
+        for(size_t i = 0; i < params.size(); i++) emit(stores[i]);
+        if(expr(body) != INT) return false;
+        emit({ 0xC9, 0xC3 });                                       // leave; ret
+
+        for(size_t patch : bails) bind(patch);
+        emit({ 0x48, 0x83, 0xE4, 0xF0, 0x48, 0xB8 });               // and rsp, -16; mov rax, jitbail
+        uint64_t target = (uint64_t)(void*)&jitbail;
+        for(int i = 0; i < 8; i++) code.push_back((uint8_t)(target >> (8 * i)));
+        emit({ 0xFF, 0xD0 });                                       // call rax
+        return true;
+    }
+};
+
+JitCode* jitcompile(UserFunction* fn){
+    lock_guard<mutex> guard(jitlock);
+    if(fn->code != nullptr || fn->nojit) return fn->code;
+
+    JitCompiler compiler(fn->parameters, fn);
+    if(!compiler.function(fn->body)){
+        fn->nojit = true;
+        return nullptr;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (compiler.code.size() + page - 1) / page * page;
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED){
+        fn->nojit = true;
+        return nullptr;
+    }
+
+    memcpy(memory, compiler.code.data(), compiler.code.size());
+    if(mprotect(memory, size, PROT_READ | PROT_EXEC) != 0){
+        munmap(memory, size);
+        fn->nojit = true;
+        return nullptr;
+    }
+
+    fn->code = new JitCode(memory, size, session, session->envversion, compiler.assumptions);
+    return fn->code;
+}
+
+#else
+
+JitCode* jitcompile(UserFunction* fn){
+    fn->nojit = true;
+    return nullptr;
+}
+
+#endif
+
+// The compiled code is only right while every operator it resolved still
+// resolves the same way in the calling session.
+bool jitvalid(JitCode* code, UserFunction* fn){
+    if(code->owner == session && code->version == session->envversion) return true;
+
+    int version = session->envversion;
+    for(auto& assumption : code->assumptions)
+        if(jitresolve(assumption.first, fn) != assumption.second) return false;
+
+    code->owner = session;
+    code->version = version;
+    return true;
+}
+
+// Runs a call natively when possible; nullptr means the interpreter has to.
+TreeNode* jitcall(UserFunction* fn, vector<TreeNode*>& args){
+    // native code cannot be stopped part way, so budgeted runs stay interpreted
+    if(fn->nojit || budgeted) return nullptr;
+
+    announceepoch();
+    JitCode* code = fn->code;
+    if(code == nullptr){
+        if(++fn->calls < jitthreshold) return nullptr;
+        code = jitcompile(fn);
+        if(code == nullptr) return nullptr;
+    }
+
+    if(!jitvalid(code, fn)){
+        // whoever unpublishes the stale code retires it; a later call recompiles
+        if(fn->code.compare_exchange_strong(code, nullptr)) retire(code, releasecode, false);
+        fn->calls = 0;
+        return nullptr;
+    }
+
+    int values[6] = { 0 };
+    for(size_t i = 0; i < args.size(); i++)
+        if(!jitint(args[i], values[i])) return nullptr;
+
+    // read before setjmp, so nothing the native call needs can be clobbered
+    int (*entry)(int, int, int, int, int, int) = (int (*)(int, int, int, int, int, int))code->entry;
+
+    jmp_buf frame;
+    jmp_buf* outer = jitframe;
+    jitframe = &frame;
+    if(setjmp(frame) != 0){
+        jitframe = outer;
+        if(++fn->bails >= jitbaillimit) fn->nojit = true;
+        return nullptr;
+    }
+
+    int result = entry(values[0], values[1], values[2], values[3], values[4], values[5]);
+    jitframe = outer;
+    return makenumnode(false, 0.0f, result);
+}
+
+TreeNode* runloop(UserFunction* fn, vector<TreeNode*>& values);
+
+// Runs fn on evaluated arguments. node is the call being made, if there is
+// one, and names the call when the body has no value.
+TreeNode* callfunction(TreeNode* node, UserFunction* fn, vector<TreeNode*>& arglist, bool islet = false){
+    if(fn->loop != nullptr) return runloop(fn, arglist);
+
+    if(!islet){
+        TreeNode* native = jitcall(fn, arglist);
+        if(native != nullptr) return native;
+    }
+
+    vector<string>& para = fn->parameters;
+    map<string, TreeNode*> origintable = localtable;
+    if(!islet) localtable.clear();
+    for(int i = 0; i < para.size(); ++i)
+        localtable[para[i]] = arglist[i];
+
+    TreeNode* result = nullptr;
+    try{
+        result = eval(fn->body); 
+    }
+    catch(EvalError& error){
+        localtable = origintable;
+        if(error.type == 6 && node != nullptr){
+            error.token = copy(node);
+            error.token->left->content = restorename(error.token->left->content);
+        }
+        throw;
+    }
+
+    localtable = origintable;
+    return result;
+}
+
+// func is the already evaluated operator of node and fn the body it runs;
+// the arguments are evaluated in place so their call site caches persist.
+TreeNode* userfunc(TreeNode* node, TreeNode* func, UserFunction* fn, bool islet = false, bool isroot = false){
+    int argsize = 0;
+    vector<string>& para = fn->parameters;
+    TreeNode* arg = node->right;
+
+    vector<TreeNode*> arglist;
+    TreeNode* walker = arg;
+    TreeNode* count = arg;
+    while(count->type == nodetype::CONS){
+        argsize++;
+        count = count->right;
+    }
+
+    if(argsize != para.size())
+        throw EvalError(2, restorename(func->content), nullptr);
+
+    while(walker->type == nodetype::CONS){
+        // arguments of a top-level ((lambda ...) ...) are top-level forms too
+        if(isroot) rootform = walker->left;
+        try{
+            arglist.push_back(eval(walker->left));
+        }
+        catch(EvalError& error){
+            if(error.type == 6 && !islet) error.type = 7;
+            if(error.type == 6 && islet){
+                error.type = 10;
+                error.token = copy(walker->left);
+            }
+            throw;
+        }
+        walker = walker->right;
+    }
+
+    ProfileFrame frame(node, func);
+    TraceSpan span(func, node);
+    return callfunction(node, fn, arglist, islet);
+}
+
+// A procedure is just a label pointing at the body it runs.
+TreeNode* procedure(UserFunction* fn){
+    TreeNode* label = new TreeNode("#<procedure lambda>", tokentype::SYMBOL);
+    label->function.store(fn, memory_order_release);
+    return label;
+}
+
+// Every procedure a lambda form makes shares the body built the first time
+// the form was checked, so evaluating it again allocates only the label.
+TreeNode* lambda(TreeNode* node){
+    UserFunction* shared = node->function.load(memory_order_acquire);
+    if(shared != nullptr) return procedure(shared);
+
+    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL)
+        throw EvalError(3, "", copy(node));
+
+    TreeNode* arglist = node->right->left;
+    TreeNode* bodylist = node->right->right;
+
+    vector<string> para;
+    TreeNode* cur = arglist;
+    while(cur->type == nodetype::CONS){
+        if(cur->left->atomtype != tokentype::SYMBOL || isreserved(cur->left->content))
+            throw EvalError(3, "", copy(node));
+
+        para.push_back(cur->left->content);
+        addlocalname(cur->left->content);
+        cur = cur->right;
+    }
+    if(cur->type != nodetype::NIL && cur->atomtype != tokentype::NIL)
+        throw EvalError(3, "", copy(node));
+
+    if(bodylist->type != nodetype::CONS)
+        throw EvalError(3, "", copy(node));
+
+    UserFunction* fn = new UserFunction(para, bodyexpr(node, bodylist));
+    UserFunction* expected = nullptr;
+    if(!node->function.compare_exchange_strong(expected, fn, memory_order_acq_rel)){
+        delete fn;
+        fn = expected;
+    }
+
+    return procedure(fn);
+}
+
+// The init or step of a loop variable; no value is reported like a let binding's.
+TreeNode* loopvalue(TreeNode* expr){
+    try{
+        return eval(expr);
+    }
+    catch(EvalError& error){
+        if(error.type == 6){
+            error.type = 10;
+            error.token = copy(expr);
+        }
+        throw;
+    }
+}
+
+// (let name ((var init) ...) body ...) is checked once and turned into the
+// procedure name is bound to, kept on the form in place of a let expansion.
+TreeNode* namedlet(TreeNode* node){
+    TreeNode* name = node->right->left;
+    if(isreserved(name->content) || node->right->right->type != nodetype::CONS || node->right->right->right->type != nodetype::CONS)
+        throw EvalError(3, "", copy(node));
+
+    vector<string> para;
+    TreeNode* cur = node->right->right->left;
+    while(cur->type == nodetype::CONS){
+        TreeNode* pair = cur->left;
+        if(pair->type != nodetype::CONS || pair->right->type != nodetype::CONS || pair->right->right->type != nodetype::NIL)
+            throw EvalError(3, "", copy(node));
+
+        TreeNode* var = pair->left;
+        if(var->atomtype != tokentype::SYMBOL || isreserved(var->content))
+            throw EvalError(3, "", copy(node));
+
+        para.push_back(var->content);
+        addlocalname(var->content);
+        cur = cur->right;
+    }
+
+    if(cur->type != nodetype::NIL && cur->atomtype != tokentype::NIL)
+        throw EvalError(3, "", copy(node));
+
+    addlocalname(name->content);
+    TreeNode* label = new TreeNode("#<procedure " + name->content + ">", tokentype::SYMBOL);
+    TreeNode* beginexpr = new TreeNode("(", new TreeNode("begin", tokentype::SYMBOL), node->right->right->right);
+    UserFunction* fn = new UserFunction(para, beginexpr);
+    fn->loop = label;
+    label->function = fn;
+    node->expansion.store(label, memory_order_release);
+    return label;
+}
+
+TreeNode* let(TreeNode* node){
+    TreeNode* letexpr = node->expansion.load(memory_order_acquire);
+    if(letexpr == nullptr && node->right->type == nodetype::CONS && node->right->left->type == nodetype::ATOM
+       && node->right->left->atomtype == tokentype::SYMBOL)
+        letexpr = namedlet(node);
+
+    if(letexpr == nullptr){
+        if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL)
+            throw EvalError(3, "", copy(node));
+
+        TreeNode* bindings = node->right->left; 
+        TreeNode* body = node->right->right;    
+
+        vector<TreeNode*> paranames;
+        vector<TreeNode*> args;
+
+        TreeNode* cur = bindings;
+        while(cur->type == nodetype::CONS){
+            TreeNode* pair = cur->left;
+
+            if(pair->type != nodetype::CONS || pair->right->type != nodetype::CONS || pair->right->right->type != nodetype::NIL)
+                throw EvalError(3, "", copy(node));
+
+            TreeNode* var = pair->left;
+            TreeNode* val = pair->right->left;
+
+            if(var->atomtype != tokentype::SYMBOL || isreserved(var->content))
+                throw EvalError(3, "", copy(node));
+
+            paranames.push_back(var);
+            args.push_back(val);
+
+            cur = cur->right;
+        }
+
+        if(cur->type != nodetype::NIL && cur->atomtype != tokentype::NIL)
+            throw EvalError(3, "", copy(node));
+
+        TreeNode* paralist = makelist(paranames);
+        TreeNode* arglist = makelist(args);
+
+        TreeNode* beginnode = new TreeNode("begin", tokentype::SYMBOL);
+        TreeNode* beginexpr = new TreeNode("(", beginnode, body);
+
+        TreeNode* lambdanode = new TreeNode("lambda", tokentype::SYMBOL);
+        TreeNode* lambdaexpr = new TreeNode("(", lambdanode, new TreeNode("(", paralist, beginexpr));
+
+        // a let is expanded into ((lambda (vars) (begin body)) vals) once
+        letexpr = new TreeNode("(", lambdaexpr, arglist);
+        node->expansion.store(letexpr, memory_order_release);
+    }
+
+    try{
+        if(letexpr->type == nodetype::ATOM){
+            vector<TreeNode*> values;
+            for(TreeNode* cur = node->right->right->left; cur->type == nodetype::CONS; cur = cur->right)
+                values.push_back(loopvalue(cur->left->right->left));
+            return runloop(findfunction(letexpr), values);
+        }
+
+        return eval(letexpr, true);
+    }
+    catch(EvalError& error){
+        if(error.type == 6) error.token = copy(node);
+        throw;
+    }
+}
+
+// Evaluates expr where it is the last thing a loop body does. A call of the
+// loop's own name there stores its arguments in values and returns nullptr,
+// so the loop goes around again instead of recursing.
+TreeNode* evaltail(TreeNode* expr, UserFunction* fn, vector<TreeNode*>& values){
+    if(expr->type != nodetype::CONS || expr->left->type != nodetype::ATOM || expr->left->atomtype != tokentype::SYMBOL
+       || !(ischecked(expr, checkedlist) || islist(expr)))
+        return eval(expr);
+
+    const string& head = expr->left->content;
+    if(head == "if") return evaltail(ifbranch(expr), fn, values);
+
+    if(head == "cond" || (head == "begin" && expr->right->type == nodetype::CONS)){
+        TreeNode* actionlist = head == "cond" ? condclause(expr) : expr->right;
+        for(; actionlist->right->type != nodetype::NIL; actionlist = actionlist->right)
+            evalvalue(actionlist->left);
+        return evaltail(actionlist->left, fn, values);
+    }
+
+    auto bound = localtable.find(head);
+    if(bound == localtable.end() || bound->second != fn->loop) return eval(expr);
+
+    size_t count = 0;
+    for(TreeNode* cur = expr->right; cur->type == nodetype::CONS; cur = cur->right) count++;
+    if(count != fn->parameters.size())
+        throw EvalError(2, head, nullptr);
+
+    // the variables keep their old values until every argument is evaluated
+    size_t i = 0;
+    for(TreeNode* cur = expr->right; cur->type == nodetype::CONS; cur = cur->right)
+        values[i++] = evalarg(cur->left);
+    return nullptr;
+}
+
+// (do ((var init step) ...) (test result ...) command ...) as a loop: the
+// steps are all evaluated before any variable is rebound.
+TreeNode* doloop(TreeNode* node){
+    if(!ischecked(node, checkeddo)){
+        if(node->right->type != nodetype::CONS || node->right->right->type != nodetype::CONS || !islist(node))
+            throw EvalError(3, "", copy(node));
+
+        TreeNode* cur = node->right->left;
+        for(; cur->type == nodetype::CONS; cur = cur->right){
+            TreeNode* spec = cur->left;
+            if(spec->type != nodetype::CONS || spec->right->type != nodetype::CONS || !islist(spec)
+               || (spec->right->right->type == nodetype::CONS && spec->right->right->right->type != nodetype::NIL))
+                throw EvalError(3, "", copy(node));
+
+            if(spec->left->atomtype != tokentype::SYMBOL || isreserved(spec->left->content))
+                throw EvalError(3, "", copy(node));
+            addlocalname(spec->left->content);
+        }
+
+        TreeNode* exit = node->right->right->left;
+        if((cur->type != nodetype::NIL && cur->atomtype != tokentype::NIL) || exit->type != nodetype::CONS || !islist(exit))
+            throw EvalError(3, "", copy(node));
+        markchecked(node, checkeddo);
+    }
+
+    TreeNode* specs = node->right->left;
+    TreeNode* exit = node->right->right->left;
+
+    vector<TreeNode*> values;
+    for(TreeNode* cur = specs; cur->type == nodetype::CONS; cur = cur->right)
+        values.push_back(loopvalue(cur->left->right->left));
+
+    map<string, TreeNode*> origintable = localtable;
+    try{
+        while(true){
+            size_t i = 0;
+            for(TreeNode* cur = specs; cur->type == nodetype::CONS; cur = cur->right)
+                localtable[cur->left->left->content] = values[i++];
+
+            if(evalarg(exit->left, 8)->atomtype != tokentype::NIL){
+                if(exit->right->type != nodetype::CONS)
+                    throw EvalError(6, "", copy(node));
+
+                TreeNode* result = actions(exit->right);
+                localtable = origintable;
+                return result;
+            }
+
+            for(TreeNode* cur = node->right->right->right; cur->type == nodetype::CONS; cur = cur->right)
+                evalvalue(cur->left);
+
+            i = 0;
+            for(TreeNode* cur = specs; cur->type == nodetype::CONS; cur = cur->right, i++)
+                if(cur->left->right->right->type == nodetype::CONS)
+                    values[i] = loopvalue(cur->left->right->right->left);
+        }
+    }
+    catch(EvalError&){
+        localtable = origintable;
+        throw;
+    }
+}
+
+// Runs a named let body with the loop variables bound on top of the
+// caller's locals, rebinding them in place for each tail call.
+TreeNode* runloop(UserFunction* fn, vector<TreeNode*>& values){
+    map<string, TreeNode*> origintable = localtable;
+    localtable[restorename(fn->loop->content)] = fn->loop;
+
+    try{
+        while(true){
+            // a loop without arguments may never reach eval, so each pass counts
+            if(checksteps()) countstep();
+            for(size_t i = 0; i < values.size(); i++)
+                localtable[fn->parameters[i]] = values[i];
+
+            TreeNode* result = evaltail(fn->body, fn, values);
+            if(result != nullptr){
+                localtable = origintable;
+                return result;
+            }
+        }
+    }
+    catch(EvalError&){
+        localtable = origintable;
+        throw;
+    }
+}
+
+struct WorkerPool{
+    vector<thread> threads;
+    vector<deque<function<void()>>> queues;
+    vector<mutex> locks;
+    mutex waitlock;
+    condition_variable wake;
+    atomic<int> pending{0};
+    atomic<unsigned> next{0};
+
+    WorkerPool(int size) : queues(size), locks(size) {
+        for(int i = 0; i < size; i++)
+            threads.emplace_back(&WorkerPool::work, this, i);
+    }
+
+    void submit(int self, function<void()> task){
+        int target = self >= 0 ? self : next++ % queues.size();
+        {
+            lock_guard<mutex> guard(locks[target]);
+            queues[target].push_back(move(task));
+        }
+        {
+            lock_guard<mutex> guard(waitlock);
+            pending++;
+        }
+        wake.notify_one();
+    }
+
+    bool runone(int self){
+        function<void()> task;
+        unsigned start = self >= 0 ? self : next.load();
+        for(size_t i = 0; i < queues.size() && !task; i++){
+            int victim = (start + i) % queues.size();
+            lock_guard<mutex> guard(locks[victim]);
+            if(queues[victim].empty()) continue;
+            if(victim == self){
+                task = move(queues[victim].back());
+                queues[victim].pop_back();
+            }
+
+            else{
+                task = move(queues[victim].front());
+                queues[victim].pop_front();
+            }
+        }
+
+        if(!task) return false;
+        pending--;
+        task();
+        return true;
+    }
+
+    void work(int self);
+};
+
+thread_local int workerid = -1;
+WorkerPool* pool = nullptr;
+once_flag poolonce;
+
+void WorkerPool::work(int self){
+    workerid = self;
+    while(true){
+        if(runone(self)) continue;
+        leaveepoch();
+        unique_lock<mutex> guard(waitlock);
+        wake.wait(guard, [this]{ return pending > 0; });
+    }
+}
+
+WorkerPool& workers(){
+    call_once(poolonce, []{ pool = new WorkerPool(max(1u, thread::hardware_concurrency())); });
+    return *pool;
+}
+
+struct TaskResult{
+    TreeNode* value = nullptr;
+    bool failed = false;
+    EvalError error = EvalError(0, "", nullptr);
+    string output;
+};
+
+void runtask(TreeNode* expr, Session* owner, map<string, TreeNode*> env, shared_ptr<Budget> shared, const atomic<bool>* cancel, TaskResult& result){
+    ostringstream captured;
+    Session* savedsession = session;
+    ostream* savedstream = outstream;
+    TreeNode* savedroot = rootform;
+    bool savedprint = needprint;
+    TaskScope scope(move(shared), cancel);
+    map<string, TreeNode*> savedlocal = move(env);
+    savedlocal.swap(localtable);
+
+    session = owner;
+    outstream = &captured;
+    rootform = nullptr;
+    try{
+        result.value = eval(expr);
+    }
+    catch(EvalError& error){
+        result.failed = true;
+        result.error = error;
+    }
+    result.output = captured.str();
+
+    localtable.swap(savedlocal);
+    session = savedsession;
+    outstream = savedstream;
+    rootform = savedroot;
+    needprint = savedprint;
+}
+
+struct Future{
+    TreeNode* expr;
+    map<string, TreeNode*> env;
+    Session* owner;
+    shared_ptr<Budget> budget;
+    shared_ptr<atomic<bool>> cancelled;
+    atomic<int> state{0};
+    mutex lock;
+    condition_variable ready;
+    TaskResult result;
+
+    Future(TreeNode* e, map<string, TreeNode*> l, Session* o, shared_ptr<Budget> b, shared_ptr<atomic<bool>> c)
+        : expr(e), env(l), owner(o), budget(b), cancelled(c) {}
+};
+
+void runfuture(Future* future){
+    int pending = 0;
+    if(!future->state.compare_exchange_strong(pending, 1)) return;
+
+    runtask(future->expr, future->owner, move(future->env), move(future->budget), future->cancelled.get(), future->result);
+    {
+        lock_guard<mutex> guard(future->lock);
+        future->state = 2;
+    }
+    future->ready.notify_all();
+    future->owner->pendingfutures--;
+}
+
+// Makes every future owner has started fail at its next evaluation step,
+// including those still queued. Futures started later are not affected.
+void cancelfutures(Session* owner){
+    unique_lock<shared_mutex> guard(owner->envlock);
+    owner->cancelled->store(true);
+    owner->cancelled = make_shared<atomic<bool>>(false);
+}
+
+// Waits until no future of owner is left running, helping with queued work
+// meanwhile; once they are cancelled, the session can then be freed.
+void waitfutures(Session* owner){
+    while(owner->pendingfutures > 0){
+        if(workers().runone(workerid)) continue;
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+}
+
+TreeNode* makefuture(TreeNode* node){
+    if(node->right->type == nodetype::NIL || node->right->right->type != nodetype::NIL)
+        throw EvalError(2, "future", nullptr);
+
+    shared_ptr<atomic<bool>> cancelled;
+    {
+        shared_lock<shared_mutex> guard(session->envlock);
+        cancelled = session->cancelled;
+    }
+
+    Future* future = new Future(node->right->left, localtable, session, budget, cancelled);
+    session->pendingfutures++;
+    TreeNode* result = new TreeNode("#<future>", tokentype::FUTURE);
+    result->future = future;
+    workers().submit(workerid, [future]{ runfuture(future); });
+
+    return result;
+}
+
+TreeNode* touch(TreeNode* node){
+    if(node->right->type == nodetype::NIL || node->right->right->type != nodetype::NIL)
+        throw EvalError(2, "touch", nullptr);
+
+    TreeNode* target = evalarg(node->right->left);
+    Future* future = target->future;
+    if(future == nullptr) return target;
+
+    runfuture(future);
+    while(future->state != 2){
+        if(workers().runone(workerid)) continue;
+        unique_lock<mutex> guard(future->lock);
+        future->ready.wait_for(guard, chrono::milliseconds(1), [future]{ return future->state == 2; });
+    }
+
+    *outstream << future->result.output;
+    if(future->result.failed)
+        throw future->result.error;
+
+    return future->result.value;
+}
+
+struct Promise{
+    TreeNode* expr;
+    map<string, TreeNode*> env;
+    bool forced;
+    TreeNode* value;
+
+    Promise(TreeNode* e, map<string, TreeNode*> l) : expr(e), env(l), forced(false), value(nullptr) {}
+};
+
+TreeNode* promisenode(Promise* promise){
+    TreeNode* result = new TreeNode("#<promise>", tokentype::PROMISE);
+    result->promise = promise;
+    return result;
+}
+
+TreeNode* forcepromise(TreeNode* target){
+    Promise* promise = target->promise;
+    if(promise == nullptr) return target;
+    if(promise->forced) return promise->value;
+
+    map<string, TreeNode*> origintable = localtable;
+    localtable = promise->env;
+    TreeNode* value = nullptr;
+    try{
+        value = eval(promise->expr);
+    }
+    catch(EvalError&){
+        localtable = origintable;
+        throw;
+    }
+    localtable = origintable;
+
+    if(!promise->forced){
+        promise->forced = true;
+        promise->value = value;
+        promise->expr = nullptr;
+        promise->env.clear();
+    }
+
+    return promise->value;
+}
+
+TreeNode* lazy(const string& op, TreeNode* node){
+    bool pair = op == "#<procedure cons-stream>";
+    if(node->right->type == nodetype::NIL || (pair && node->right->right->type == nodetype::NIL)
+        || (pair ? node->right->right->right : node->right->right)->type != nodetype::NIL)
+        throw EvalError(2, restorename(op), nullptr);
+
+    if(op == "#<procedure delay>")
+        return promisenode(new Promise(node->right->left, localtable));
+
+    TreeNode* target = evalarg(node->right->left);
+    if(pair)
+        return new TreeNode("(", target, promisenode(new Promise(node->right->right->left, localtable)));
+
+    if(op == "#<procedure make-promise>"){
+        if(target->promise != nullptr) return target;
+
+        Promise* promise = new Promise(nullptr, {});
+        promise->forced = true;
+        promise->value = target;
+        return promisenode(promise);
+    }
+
+    if(op == "#<procedure stream-car>" || op == "#<procedure stream-cdr>"){
+        if(target->type != nodetype::CONS)
+            throw EvalError(5, restorename(op), copy(target));
+
+        if(op == "#<procedure stream-car>")
+            return target->left;
+
+        target = target->right;
+    }
+
+    return forcepromise(target);
+}
+
+void runparallel(vector<TreeNode*>& exprs, vector<TaskResult>& results){
+    WorkerPool& pool = workers();
+    size_t chunk = max<size_t>(1, exprs.size() / (pool.queues.size() * 4));
+    size_t tasks = (exprs.size() + chunk - 1) / chunk;
+    atomic<size_t> done(0);
+    Session* owner = session;
+    shared_ptr<Budget> shared = budget;
+    const atomic<bool>* cancel = cancelflag;
+
+    results.assign(exprs.size(), TaskResult());
+    for(size_t start = 0; start < exprs.size(); start += chunk){
+        pool.submit(workerid, [&, start]{
+            for(size_t i = start; i < exprs.size() && i < start + chunk; i++)
+                runtask(exprs[i], owner, {}, shared, cancel, results[i]);
+            done++;
+        });
+    }
+
+    while(done < tasks){
+        announceepoch();
+        if(!pool.runone(workerid)) this_thread::yield();
+    }
+}
+
+bool listelements(TreeNode* lst, vector<TreeNode*>& elems){
+    if(lst->type == nodetype::ATOM) return lst->atomtype == tokentype::NIL;
+
+    TreeNode* cur = lst;
+    while(cur->type == nodetype::CONS){
+        elems.push_back(cur->left);
+        cur = cur->right;
+    }
+
+    return cur->type == nodetype::NIL || cur->atomtype == tokentype::NIL;
+}
+
+bool isempty(TreeNode* node){
+    return node->type == nodetype::NIL || (node->type == nodetype::ATOM && node->atomtype == tokentype::NIL);
+}
+
+// Turns the cell chain left over after some elements into a value of its own.
+TreeNode* restvalue(TreeNode* cell){
+    if(cell->type == nodetype::CONS) return new TreeNode("(", cell->left, cell->right);
+    if(cell->type == nodetype::NIL) return falsenode();
+    return cell;
+}
+
+TreeNode* applynode(TreeNode* func, vector<TreeNode*>& args){
+    vector<TreeNode*> elems = { func };
+    for(TreeNode* arg : args){
+        if(arg->type == nodetype::ATOM && arg->atomtype == tokentype::SYMBOL && isprocedure(arg->content)){
+            elems.push_back(arg);
+            continue;
+        }
+
+        if(arg->type == nodetype::ATOM && arg->atomtype == tokentype::SYMBOL){
+            arg = copy(arg);
+            arg->atomtype = tokentype::ATOM;
+        }
+
+        vector<TreeNode*> quoted = { new TreeNode("quote", tokentype::SYMBOL), arg };
+        elems.push_back(makelist(quoted));
+    }
+
+    return makelist(elems);
+}
+
+TreeNode* parallelmap(const string& op, TreeNode* node){
+    if(node->right->type == nodetype::NIL || node->right->right->type == nodetype::NIL || node->right->right->right->type != nodetype::NIL)
+        throw EvalError(2, restorename(op), nullptr);
+
+    TreeNode* func = evalarg(node->right->left);
+    TreeNode* lst = evalarg(node->right->right->left);
+
+    vector<TreeNode*> elems;
+    TreeNode* wrong = nullptr;
+    if(func->type != nodetype::ATOM || !isprocedure(func->content)) wrong = func;
+    else if(!listelements(lst, elems)) wrong = lst;
+    if(wrong != nullptr)
+        throw EvalError(5, restorename(op), copy(wrong));
+
+    vector<TreeNode*> exprs;
+    for(TreeNode* elem : elems){
+        vector<TreeNode*> args = { elem };
+        exprs.push_back(applynode(func, args));
+    }
+
+    vector<TaskResult> results;
+    runparallel(exprs, results);
+
+    vector<TreeNode*> values;
+    for(TaskResult& result : results){
+        *outstream << result.output;
+        if(result.failed){
+            if(result.error.type == 6) result.error.type = 7;
+            throw result.error;
+        }
+
+        values.push_back(result.value);
+    }
+
+    if(op == "#<procedure pfor-each>") return truenode();
+    return makelist(values);
+}
+
+// Native list library. Every builtin walks the cons cells itself and
+// allocates only the cells of the list it returns.
+bool islistlibrary(const string& op){
+    return op == "#<procedure length>" || op == "#<procedure append>" || op == "#<procedure reverse>" || op == "#<procedure map>"
+        || op == "#<procedure filter>" || op == "#<procedure fold>" || op == "#<procedure assoc>" || op == "#<procedure member>"
+        || op == "#<procedure sort>";
+}
+
+// Number of elements of a proper list, or -1 when lst is not one.
+int listlength(TreeNode* lst){
+    int length = 0;
+    TreeNode* cur = lst;
+    while(cur->type == nodetype::CONS){
+        length++;
+        cur = cur->right;
+    }
+
+    return isempty(cur) ? length : -1;
+}
+
+// Checks the operand count before evaluating any operand, as the other builtins do.
+void listoperands(const string& name, TreeNode* node, int least, int most, vector<TreeNode*>& args){
+    int count = 0;
+    for(TreeNode* cur = node->right; cur->type == nodetype::CONS; cur = cur->right) count++;
+    if(count < least || (most >= 0 && count > most))
+        throw EvalError(2, name, nullptr);
+
+    for(TreeNode* cur = node->right; cur->type == nodetype::CONS; cur = cur->right)
+        args.push_back(evalarg(cur->left));
+}
+
+void pushcell(TreeNode*& head, TreeNode*& last, TreeNode* elem){
+    TreeNode* cell = new TreeNode(head == nullptr ? "(" : "", elem, nullptr);
+    if(head == nullptr) head = cell;
+    else last->right = cell;
+    last = cell;
+}
+
+// Finishes a list built by pushcell with tail as its final cdr.
+TreeNode* endlist(TreeNode* head, TreeNode* last, TreeNode* tail){
+    if(head == nullptr) return isempty(tail) ? falsenode() : tail;
+
+    if(isempty(tail)) last->right = new TreeNode(nodetype::NIL);
+    else last->right = tail->type == nodetype::CONS ? new TreeNode("", tail->left, tail->right) : tail;
+    return head;
+}
+
+// equal? as member and assoc need it: a symbol from a quoted list and the
+// same symbol produced by quote are the same value.
+bool samevalue(TreeNode* a, TreeNode* b){
+    if(isempty(a) || isempty(b)) return isempty(a) && isempty(b);
+    if(a->type != b->type) return false;
+
+    if(a->type == nodetype::ATOM){
+        auto kind = [](tokentype type){ return type == tokentype::ATOM ? tokentype::SYMBOL : type; };
+        return kind(a->atomtype) == kind(b->atomtype) && a->content == b->content;
+    }
+
+    return samevalue(a->left, b->left) && samevalue(a->right, b->right);
+}
+
+// Calls a procedure value on evaluated arguments. User functions run their
+// body directly; builtins get a call form, since they read their operands from one.
+TreeNode* applyvalue(TreeNode* func, vector<TreeNode*> args){
+    UserFunction* fn = findfunction(func);
+    try{
+        if(fn == nullptr) return eval(applynode(func, args));
+        if(args.size() != fn->parameters.size())
+            throw EvalError(2, restorename(func->content), nullptr);
+
+        for(TreeNode*& arg : args){
+            if(arg->type == nodetype::ATOM && arg->atomtype == tokentype::SYMBOL && !isprocedure(arg->content)){
+                arg = copy(arg);
+                arg->atomtype = tokentype::ATOM;
+            }
+        }
+
+        ProfileFrame frame(nullptr, func);
+        TraceSpan span(func, nullptr);
+        return callfunction(nullptr, fn, args);
+    }
+    catch(EvalError& error){
+        if(error.type != 6) throw;
+        error.type = 7;
+        error.token = applynode(func, args);
+        error.token->left = new TreeNode(restorename(func->content), tokentype::SYMBOL);
+        throw;
+    }
+}
+
+// Stable merge sort used by sort. Runs are merged through buffer, taking
+// from the left run on ties so equal elements keep their order.
+template<typename T, typename Less> void mergeruns(vector<T>& items, vector<T>& buffer, size_t lo, size_t mid, size_t hi, Less& less){
+    size_t i = lo, j = mid, k = lo;
+    while(i < mid && j < hi)
+        buffer[k++] = less(items[j], items[i]) ? items[j++] : items[i++];
+    while(i < mid) buffer[k++] = items[i++];
+    while(j < hi) buffer[k++] = items[j++];
+    copy_n(buffer.begin() + lo, hi - lo, items.begin() + lo);
+}
+
+template<typename T, typename Less> void mergesort(vector<T>& items, vector<T>& buffer, size_t lo, size_t hi, Less& less){
+    for(size_t width = 1; width < hi - lo; width *= 2)
+        for(size_t start = lo; start + width < hi; start += 2 * width)
+            mergeruns(items, buffer, start, start + width, min(start + 2 * width, hi), less);
+}
+
+// Lists at least this long are sorted in chunks on the worker pool, then
+// merged pairwise, each round's merges running in parallel too.
+const size_t sortparallel = 1 << 14;
+
+void runchunks(size_t count, const function<void(size_t)>& body){
+    WorkerPool& pool = workers();
+    atomic<size_t> done(0);
+    shared_ptr<Budget> shared = budget;
+    const atomic<bool>* cancel = cancelflag;
+    for(size_t i = 0; i < count; i++){
+        pool.submit(workerid, [&, i]{
+            TaskScope scope(shared, cancel);
+            body(i);
+            done++;
+        });
+    }
+
+    while(done < count){
+        announceepoch();
+        if(!pool.runone(workerid)) this_thread::yield();
+    }
+}
+
+template<typename T, typename Less> void sortitems(vector<T>& items, Less less){
+    vector<T> buffer(items.size());
+    if(items.size() < sortparallel){
+        mergesort(items, buffer, 0, items.size(), less);
+        return;
+    }
+
+    size_t chunks = workers().queues.size();
+    size_t width = (items.size() + chunks - 1) / chunks;
+    runchunks(chunks, [&](size_t i){
+        size_t lo = min(i * width, items.size());
+        mergesort(items, buffer, lo, min(lo + width, items.size()), less);
+    });
+
+    for(; width < items.size(); width *= 2){
+        size_t pairs = (items.size() + 2 * width - 1) / (2 * width);
+        runchunks(pairs, [&](size_t i){
+            size_t lo = i * 2 * width;
+            if(lo + width < items.size())
+                mergeruns(items, buffer, lo, lo + width, min(lo + 2 * width, items.size()), less);
+        });
+    }
+}
+
+// (sort lst less?) returns a new sorted list; the argument may be a quoted
+// constant, so its cells are never reordered in place. The builtin < and
+// string<? compare precomputed keys without calling back into eval.
+TreeNode* sortlist(const string& name, TreeNode* node){
+    vector<TreeNode*> args;
+    listoperands(name, node, 2, 2, args);
+
+    vector<TreeNode*> elems;
+    if(!listelements(args[0], elems)) throw EvalError(5, name, copy(args[0]));
+
+    TreeNode* less = args[1];
+    if(less->type != nodetype::ATOM || !isprocedure(less->content))
+        throw EvalError(5, name, copy(less));
+
+    bool builtin = findfunction(less) == nullptr;
+    if(builtin && less->content == "#<procedure <>" && elems.size() > 1){
+        vector<pair<float, TreeNode*>> keys;
+        for(TreeNode* elem : elems){
+            if(elem->atomtype != tokentype::INT && elem->atomtype != tokentype::FLOAT)
+                throw EvalError(5, "<", copy(elem));
+
+            Numbertype num = stringtrans(elem);
+            keys.push_back({ num.isFloat ? num.floatValue : (float)num.intValue, elem });
+        }
+
+        sortitems(keys, [](const pair<float, TreeNode*>& a, const pair<float, TreeNode*>& b){ return a.first < b.first; });
+        for(size_t i = 0; i < keys.size(); i++) elems[i] = keys[i].second;
+    }
+
+    else if(builtin && less->content == "#<procedure string<?>" && elems.size() > 1){
+        vector<pair<string_view, TreeNode*>> keys;
+        for(TreeNode* elem : elems){
+            if(elem->atomtype != tokentype::STRING)
+                throw EvalError(5, "string<?", copy(elem));
+
+            keys.push_back({ string_view(elem->content).substr(1, elem->content.size() - 2), elem });
+        }
+
+        sortitems(keys, [](const pair<string_view, TreeNode*>& a, const pair<string_view, TreeNode*>& b){ return a.first < b.first; });
+        for(size_t i = 0; i < keys.size(); i++) elems[i] = keys[i].second;
+    }
+
+    else{
+        // user predicates run on this thread, where their environment lives
+        vector<TreeNode*> buffer(elems.size());
+        auto before = [&](TreeNode* a, TreeNode* b){ return applyvalue(less, { a, b })->atomtype != tokentype::NIL; };
+        mergesort(elems, buffer, 0, elems.size(), before);
+    }
+
+    TreeNode* head = nullptr;
+    TreeNode* last = nullptr;
+    for(TreeNode* elem : elems) pushcell(head, last, elem);
+    return endlist(head, last, falsenode());
+}
+
+TreeNode* listlibrary(const string& op, TreeNode* node){
+    string name = restorename(op);
+    vector<TreeNode*> args;
+    TreeNode* head = nullptr;
+    TreeNode* last = nullptr;
+
+    if(name == "sort") return sortlist(name, node);
+
+    if(name == "length"){
+        listoperands(name, node, 1, 1, args);
+        int length = listlength(args[0]);
+        if(length < 0) throw EvalError(5, name, copy(args[0]));
+        return makenumnode(false, 0.0f, length);
+    }
+
+    if(name == "reverse"){
+        listoperands(name, node, 1, 1, args);
+        if(listlength(args[0]) < 0) throw EvalError(5, name, copy(args[0]));
+
+        TreeNode* result = new TreeNode(nodetype::NIL);
+        for(TreeNode* cur = args[0]; cur->type == nodetype::CONS; cur = cur->right)
+            result = new TreeNode("", cur->left, result);
+        if(result->type == nodetype::NIL) return falsenode();
+
+        result->content = "(";
+        return result;
+    }
+
+    if(name == "append"){
+        listoperands(name, node, 0, -1, args);
+        if(args.empty()) return falsenode();
+
+        for(size_t i = 0; i + 1 < args.size(); i++){
+            if(listlength(args[i]) < 0) throw EvalError(5, name, copy(args[i]));
+            for(TreeNode* cur = args[i]; cur->type == nodetype::CONS; cur = cur->right)
+                pushcell(head, last, cur->left);
+        }
+
+        return endlist(head, last, args.back());
+    }
+
+    if(name == "map" || name == "filter" || name == "fold"){
+        if(name == "map") listoperands(name, node, 2, -1, args);
+        else listoperands(name, node, name == "fold" ? 3 : 2, name == "fold" ? 3 : 2, args);
+
+        TreeNode* func = args[0];
+        if(func->type != nodetype::ATOM || !isprocedure(func->content))
+            throw EvalError(5, name, copy(func));
+
+        size_t first = name == "fold" ? 2 : 1;
+        for(size_t i = first; i < args.size(); i++)
+            if(listlength(args[i]) < 0) throw EvalError(5, name, copy(args[i]));
+
+        if(name == "fold"){
+            TreeNode* acc = args[1];
+            for(TreeNode* cur = args[2]; cur->type == nodetype::CONS; cur = cur->right)
+                acc = applyvalue(func, { cur->left, acc });
+            return acc;
+        }
+
+        if(name == "filter"){
+            for(TreeNode* cur = args[1]; cur->type == nodetype::CONS; cur = cur->right)
+                if(applyvalue(func, { cur->left })->atomtype != tokentype::NIL)
+                    pushcell(head, last, cur->left);
+            return endlist(head, last, falsenode());
+        }
+
+        // map stops at the end of the shortest list
+        vector<TreeNode*> cursors(args.begin() + 1, args.end());
+        vector<TreeNode*> elems(cursors.size());
+        while(all_of(cursors.begin(), cursors.end(), [](TreeNode* cur){ return cur->type == nodetype::CONS; })){
+            for(size_t i = 0; i < cursors.size(); i++){
+                elems[i] = cursors[i]->left;
+                cursors[i] = cursors[i]->right;
+            }
+            pushcell(head, last, applyvalue(func, elems));
+        }
+        return endlist(head, last, falsenode());
+    }
+
+    // member and assoc
+    listoperands(name, node, 2, 2, args);
+    if(listlength(args[1]) < 0) throw EvalError(5, name, copy(args[1]));
+
+    for(TreeNode* cur = args[1]; cur->type == nodetype::CONS; cur = cur->right){
+        if(name == "member" && samevalue(args[0], cur->left)) return restvalue(cur);
+        if(name == "assoc"){
+            if(cur->left->type != nodetype::CONS) throw EvalError(5, name, copy(args[1]));
+            if(samevalue(args[0], cur->left->left)) return cur->left;
+        }
+    }
+
+    return falsenode();
+}
 
-        if(lambdatable.count(funcNode)){
-            /*TreeNode* temp = copy(node);
-            temp->left = funcNode;
-            
-            return userfunc(temp);*/
-            return userfunc(node);
+// define-syntax / syntax-rules. Macro uses are expanded by expand() when a
+// top-level form is read, before it is evaluated, so each call site is
+// rewritten exactly once and costs nothing at run time.
+struct Macro{
+    TreeNode* form;
+    set<string> literals;
+    vector<pair<TreeNode*, TreeNode*>> rules;
+};
+
+struct MacroBinding{
+    TreeNode* node = nullptr;
+    bool repeated = false;
+    vector<MacroBinding> items;
+};
+
+atomic<int> macrocounter(0);
+
+bool issymbol(TreeNode* node, const string& name){
+    return node->type == nodetype::ATOM && (node->atomtype == tokentype::SYMBOL || node->atomtype == tokentype::QUOTE) && node->content == name;
+}
+
+TreeNode* buildlist(vector<TreeNode*>& elems, TreeNode* tail){
+    if(elems.empty()) return tail == nullptr ? falsenode() : tail;
+
+    TreeNode* head = makelist(elems);
+    if(tail == nullptr || isempty(tail)) return head;
+
+    TreeNode* last = head;
+    while(last->right->type == nodetype::CONS) last = last->right;
+    last->right = tail->type == nodetype::CONS ? new TreeNode("", tail->left, tail->right) : tail;
+    return head;
+}
+
+void patternvars(TreeNode* pattern, Macro* macro, vector<string>& vars){
+    if(pattern->type == nodetype::CONS){
+        patternvars(pattern->left, macro, vars);
+        patternvars(pattern->right, macro, vars);
+    }
+
+    else if(pattern->type == nodetype::ATOM && pattern->atomtype == tokentype::SYMBOL && pattern->content != "_"
+            && pattern->content != "..." && !macro->literals.count(pattern->content))
+        vars.push_back(pattern->content);
+}
+
+bool matchpattern(TreeNode* pattern, TreeNode* form, Macro* macro, map<string, MacroBinding>& bindings);
+
+bool matchcells(TreeNode* pattern, TreeNode* form, Macro* macro, map<string, MacroBinding>& bindings){
+    if(pattern->type == nodetype::CONS && pattern->right->type == nodetype::CONS && issymbol(pattern->right->left, "...")){
+        TreeNode* rest = pattern->right->right;
+        int restsize = 0;
+        for(TreeNode* cur = rest; cur->type == nodetype::CONS; cur = cur->right) restsize++;
+
+        vector<TreeNode*> items;
+        for(TreeNode* cur = form; cur->type == nodetype::CONS; cur = cur->right) items.push_back(cur->left);
+        if(items.size() < restsize) return false;
+
+        vector<string> vars;
+        patternvars(pattern->left, macro, vars);
+        for(const string& var : vars) bindings[var].repeated = true;
+
+        for(int i = 0; i < items.size() - restsize; i++){
+            map<string, MacroBinding> item;
+            if(!matchpattern(pattern->left, items[i], macro, item)) return false;
+            for(const string& var : vars) bindings[var].items.push_back(item[var]);
+            form = form->right;
+        }
+
+        return matchcells(rest, form, macro, bindings);
+    }
+
+    if(pattern->type == nodetype::CONS){
+        if(form->type != nodetype::CONS) return false;
+        return matchpattern(pattern->left, form->left, macro, bindings) && matchcells(pattern->right, form->right, macro, bindings);
+    }
+
+    if(isempty(pattern)) return isempty(form);
+    return matchpattern(pattern, restvalue(form), macro, bindings);
+}
+
+bool matchpattern(TreeNode* pattern, TreeNode* form, Macro* macro, map<string, MacroBinding>& bindings){
+    if(pattern->type == nodetype::CONS)
+        return form->type == nodetype::CONS && matchcells(pattern, form, macro, bindings);
+
+    if(isempty(pattern)) return isempty(form);
+
+    if(pattern->atomtype == tokentype::SYMBOL){
+        if(pattern->content == "_") return true;
+        if(macro->literals.count(pattern->content)) return issymbol(form, pattern->content);
+        bindings[pattern->content].node = form;
+        return true;
+    }
+
+    return form->type == nodetype::ATOM && form->atomtype == pattern->atomtype && form->content == pattern->content;
+}
+
+// Binders a template introduces itself; they are renamed on every expansion
+// so they can never capture a variable of the code passed to the macro. That
+// covers the parameters of lambda and of (define (f ...) ...), let and do
+// variables and named-let loop names; the name a define introduces is meant to
+// be seen by the caller and keeps its name.
+void templatebinders(TreeNode* tmpl, map<string, MacroBinding>& bindings, set<string>& binders){
+    if(tmpl->type != nodetype::CONS || issymbol(tmpl->left, "quote")) return;
+
+    vector<TreeNode*> names;
+    TreeNode* rest = tmpl->right;
+    if(issymbol(tmpl->left, "lambda") && rest->type == nodetype::CONS){
+        for(TreeNode* cur = rest->left; cur->type == nodetype::CONS; cur = cur->right)
+            names.push_back(cur->left);
+    }
+
+    else if((issymbol(tmpl->left, "let") || issymbol(tmpl->left, "do")) && rest->type == nodetype::CONS){
+        if(issymbol(tmpl->left, "let") && rest->left->type == nodetype::ATOM && rest->right->type == nodetype::CONS){
+            names.push_back(rest->left);
+            rest = rest->right;
+        }
+
+        for(TreeNode* cur = rest->left; cur->type == nodetype::CONS; cur = cur->right)
+            if(cur->left->type == nodetype::CONS) names.push_back(cur->left->left);
+    }
+
+    else if(issymbol(tmpl->left, "define") && rest->type == nodetype::CONS && rest->left->type == nodetype::CONS){
+        for(TreeNode* cur = rest->left->right; cur->type == nodetype::CONS; cur = cur->right)
+            names.push_back(cur->left);
+    }
+
+    for(TreeNode* name : names)
+        if(name->type == nodetype::ATOM && name->atomtype == tokentype::SYMBOL && name->content != "..." && !bindings.count(name->content))
+            binders.insert(name->content);
+
+    for(TreeNode* cur = tmpl; cur->type == nodetype::CONS; cur = cur->right)
+        templatebinders(cur->left, bindings, binders);
+}
+
+TreeNode* instantiate(TreeNode* tmpl, Macro* macro, map<string, MacroBinding>& bindings, map<string, string>& renames, bool quoted){
+    if(tmpl->type == nodetype::ATOM){
+        if(tmpl->atomtype == tokentype::SYMBOL && bindings.count(tmpl->content)){
+            MacroBinding& binding = bindings[tmpl->content];
+            if(binding.repeated) throw EvalError(3, "", copy(macro->form));
+            return copy(binding.node);   // expand rewrites nodes in place, so no two uses may share one
+        }
+
+        TreeNode* atom = copy(tmpl);
+        if(!quoted && tmpl->atomtype == tokentype::SYMBOL && renames.count(tmpl->content))
+            atom->content = renames[tmpl->content];
+        return atom;
+    }
+
+    if(tmpl->type != nodetype::CONS) return falsenode();
+
+    quoted = quoted || issymbol(tmpl->left, "quote");
+    vector<TreeNode*> elems;
+    TreeNode* cur = tmpl;
+    for(; cur->type == nodetype::CONS; cur = cur->right){
+        if(cur->right->type == nodetype::CONS && issymbol(cur->right->left, "...")){
+            vector<string> vars;
+            patternvars(cur->left, macro, vars);
+
+            int count = -1;
+            for(const string& var : vars){
+                auto binding = bindings.find(var);
+                if(binding == bindings.end() || !binding->second.repeated) continue;
+                if(count >= 0 && count != binding->second.items.size()) throw EvalError(3, "", copy(macro->form));
+                count = binding->second.items.size();
+            }
+            if(count < 0) throw EvalError(3, "", copy(macro->form));
+
+            for(int i = 0; i < count; i++){
+                map<string, MacroBinding> item = bindings;
+                for(const string& var : vars)
+                    if(bindings.count(var) && bindings[var].repeated) item[var] = bindings[var].items[i];
+                elems.push_back(instantiate(cur->left, macro, item, renames, quoted));
+            }
+
+            cur = cur->right;
+            continue;
+        }
+
+        elems.push_back(instantiate(cur->left, macro, bindings, renames, quoted));
+    }
+
+    TreeNode* tail = cur->type == nodetype::NIL ? nullptr : instantiate(cur, macro, bindings, renames, quoted);
+    return buildlist(elems, tail);
+}
+
+TreeNode* transcribe(Macro* macro, TreeNode* form){
+    for(auto& rule : macro->rules){
+        map<string, MacroBinding> bindings;
+        if(!matchcells(rule.first->right, form->right, macro, bindings)) continue;
+
+        set<string> binders;
+        templatebinders(rule.second, bindings, binders);
+        map<string, string> renames;
+        int serial = ++macrocounter;
+        for(const string& binder : binders)
+            renames[binder] = binder + ";" + to_string(serial);   // ';' never survives the reader
+
+        return instantiate(rule.second, macro, bindings, renames, false);
+    }
+
+    throw EvalError(15, form->left->content, copy(form));
+}
+
+TreeNode* expand(TreeNode* node, int depth = 0);
+
+// Expands each element of a list, treating none of them as the list's head.
+void expandeach(TreeNode* list, int depth, int skip = 0){
+    for(TreeNode* cur = list; cur->type == nodetype::CONS; cur = cur->right)
+        if(skip-- <= 0) cur->left = expand(cur->left, depth);
+}
+
+// Binding lists of let and do: only the expressions after each name are code.
+void expandbindings(TreeNode* bindings, int depth){
+    for(TreeNode* cur = bindings; cur->type == nodetype::CONS; cur = cur->right)
+        if(cur->left->type == nodetype::CONS) expandeach(cur->left, depth, 1);
+}
+
+// Rewrites macro uses in a form. Only positions that hold expressions are
+// expanded: quoted data, parameter and binding lists and cond clauses are not
+// forms themselves, even when their first element names a macro.
+TreeNode* expand(TreeNode* node, int depth){
+    if(node->type != nodetype::CONS || issymbol(node->left, "quote") || issymbol(node->left, "define-syntax")) return node;
+
+    if(node->left->type == nodetype::ATOM && node->left->atomtype == tokentype::SYMBOL){
+        auto macro = session->macros.find(node->left->content);
+        if(macro != session->macros.end()){
+            if(depth > 1000) throw EvalError(15, node->left->content, copy(node));
+            return expand(transcribe(macro->second, node), depth + 1);
+        }
+    }
+
+    TreeNode* rest = node->right;
+    if(rest->type == nodetype::CONS){
+        if(issymbol(node->left, "lambda") || (issymbol(node->left, "define") && rest->left->type == nodetype::CONS)){
+            expandeach(rest->right, depth);
+            return node;
+        }
+
+        if(issymbol(node->left, "let")){
+            if(rest->left->atomtype == tokentype::SYMBOL && rest->right->type == nodetype::CONS) rest = rest->right;
+            expandbindings(rest->left, depth);
+            expandeach(rest->right, depth);
+            return node;
+        }
+
+        if(issymbol(node->left, "cond")){
+            for(TreeNode* clause = rest; clause->type == nodetype::CONS; clause = clause->right)
+                if(clause->left->type == nodetype::CONS) expandeach(clause->left, depth);
+            return node;
+        }
+
+        if(issymbol(node->left, "do")){
+            expandbindings(rest->left, depth);
+            if(rest->right->type == nodetype::CONS){
+                if(rest->right->left->type == nodetype::CONS) expandeach(rest->right->left, depth);
+                expandeach(rest->right->right, depth);
+            }
+            return node;
+        }
+    }
+
+    expandeach(node, depth);
+    return node;
+}
+
+TreeNode* definesyntax(TreeNode* node){
+    vector<TreeNode*> parts;
+    if(!listelements(node, parts) || parts.size() != 3) throw EvalError(3, "", copy(node));
+
+    TreeNode* name = parts[1];
+    vector<TreeNode*> rules;
+    if(name->atomtype != tokentype::SYMBOL || isreserved(name->content) || !listelements(parts[2], rules)
+       || rules.size() < 2 || !issymbol(rules[0], "syntax-rules"))
+        throw EvalError(3, "", copy(node));
+
+    Macro* macro = new Macro();
+    macro->form = node;
+    vector<TreeNode*> literals;
+    if(!listelements(rules[1], literals)) throw EvalError(3, "", copy(node));
+    for(TreeNode* literal : literals){
+        if(literal->atomtype != tokentype::SYMBOL) throw EvalError(3, "", copy(node));
+        macro->literals.insert(literal->content);
+    }
+
+    for(int i = 2; i < rules.size(); i++){
+        vector<TreeNode*> rule;
+        if(!listelements(rules[i], rule) || rule.size() != 2 || rule[0]->type != nodetype::CONS)
+            throw EvalError(3, "", copy(node));
+        macro->rules.push_back({ rule[0], rule[1] });
+    }
+
+    {
+        unique_lock<shared_mutex> guard(session->envlock);
+        session->macros[name->content] = macro;
+    }
+
+    if(session->verbose) *outstream << endl << "> " << name->content << " defined" << endl;
+    needprint = false;
+    return name;
+}
+
+TreeNode* exit(TreeNode* node){
+    if(node->right->type != nodetype::NIL)
+        throw EvalError(2, "exit", nullptr);
+
+    return exitnode();
+}
+
+void clear(){
+    cancelfutures(session);
+    unique_lock<shared_mutex> guard(session->envlock);
+    for(auto& pair : session->definetable){
+        if(pair.second != nullptr){
+            //delete pair.second;
+            pair.second = nullptr;
+        }
+    }
+
+    for(auto& pair : localtable){
+        if(pair.second != nullptr){
+            //delete pair.second;
+            pair.second = nullptr;
+        }
+    }
+
+    session->definetable.clear();
+    localtable.clear();
+    session->functionalias.clear();
+    session->macros.clear();
+    session->envversion = ++versioncounter;
+}
+
+struct ImageHeader{
+    char magic[8];
+    uint32_t nodecount;
+    uint32_t funccount;
+    uint32_t paramcount;
+    uint32_t definecount;
+    uint32_t aliascount;
+    uint32_t stringbytes;
+};
+
+struct ImageString{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct ImageNode{
+    uint8_t type;
+    uint8_t atomtype;
+    ImageString content;
+    int32_t left;
+    int32_t right;
+    int32_t line;
+    int32_t column;
+};
+
+struct ImageFunction{
+    int32_t label;
+    int32_t body;
+    uint32_t firstparam;
+    uint32_t paramcount;
+};
+
+struct ImageBinding{
+    ImageString name;
+    int32_t node;
+    ImageString alias;
+};
+
+const char imagemagic[8] = {'O', 'S', 'I', 'M', 'G', '0', '0', '2'};
+
+struct ImageWriter{
+    vector<ImageNode> nodes;
+    vector<ImageFunction> funcs;
+    vector<ImageString> params;
+    vector<ImageBinding> bindings;
+    vector<TreeNode*> labels;
+    string strings;
+    map<TreeNode*, int32_t> index;
+    map<string, uint32_t> interned;
+
+    ImageString intern(const string& str){
+        auto it = interned.find(str);
+        if(it == interned.end()){
+            it = interned.emplace(str, strings.size()).first;
+            strings += str;
+        }
+
+        return { it->second, (uint32_t)str.size() };
+    }
+
+    int32_t add(TreeNode* root){
+        if(root == nullptr) return -1;
+
+        vector<TreeNode*> pending = { root };
+        while(!pending.empty()){
+            TreeNode* node = pending.back();
+            pending.pop_back();
+            if(node == nullptr || index.count(node)) continue;
+
+            // value-initialized in place, so the padding after atomtype is written
+            // as zeros; only atoms have an atomtype, the others store 0
+            index[node] = nodes.size();
+            nodes.emplace_back();
+            ImageNode& record = nodes.back();
+            record.type = (uint8_t)node->type;
+            record.atomtype = node->type == nodetype::ATOM ? (uint8_t)node->atomtype : 0;
+            record.content = intern(node->content);
+            record.left = -1;
+            record.right = -1;
+            record.line = node->line;
+            record.column = node->column;
+            pending.push_back(node->right);
+            pending.push_back(node->left);
+
+            UserFunction* fn = node->type == nodetype::ATOM ? findfunction(node) : nullptr;
+            if(fn != nullptr){
+                funcs.push_back({ index[node], -1, (uint32_t)params.size(), (uint32_t)fn->parameters.size() });
+                labels.push_back(node);
+                for(const string& para : fn->parameters)
+                    params.push_back(intern(para));
+                pending.push_back(fn->body);
+            }
+        }
+
+        return index[root];
+    }
+
+    void link(){
+        for(auto& pair : index){
+            ImageNode& record = nodes[pair.second];
+            record.left = pair.first->left == nullptr ? -1 : index[pair.first->left];
+            record.right = pair.first->right == nullptr ? -1 : index[pair.first->right];
+        }
+
+        for(size_t i = 0; i < funcs.size(); i++)
+            funcs[i].body = index[findfunction(labels[i])->body];
+    }
+};
+
+bool saveimage(const string& path){
+    ImageWriter writer;
+    for(auto& pair : session->definetable)
+        writer.bindings.push_back({ writer.intern(pair.first), writer.add(pair.second), { 0, 0 } });
+
+    for(auto& pair : session->functionalias)
+        writer.bindings.push_back({ writer.intern(pair.first), -1, writer.intern(pair.second) });
+
+    writer.link();
+
+    ImageHeader header{};
+    memcpy(header.magic, imagemagic, sizeof(imagemagic));
+    header.nodecount = writer.nodes.size();
+    header.funccount = writer.funcs.size();
+    header.paramcount = writer.params.size();
+    header.definecount = session->definetable.size();
+    header.aliascount = session->functionalias.size();
+    header.stringbytes = writer.strings.size();
+
+    ofstream out(path, ios::binary | ios::trunc);
+    if(!out) return false;
+
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)writer.nodes.data(), writer.nodes.size() * sizeof(ImageNode));
+    out.write((const char*)writer.funcs.data(), writer.funcs.size() * sizeof(ImageFunction));
+    out.write((const char*)writer.params.data(), writer.params.size() * sizeof(ImageString));
+    out.write((const char*)writer.bindings.data(), writer.bindings.size() * sizeof(ImageBinding));
+    out.write(writer.strings.data(), writer.strings.size());
+    return (bool)out;
+}
+
+bool loadimage(const string& path){
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat info;
+    if(fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(ImageHeader)){
+        close(fd);
+        return false;
+    }
+
+    size_t size = info.st_size;
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED) return false;
+
+    const char* base = (const char*)mapped;
+    const ImageHeader* header = (const ImageHeader*)base;
+    size_t bindingcount = (size_t)header->definecount + header->aliascount;
+    size_t expected = sizeof(ImageHeader) + (size_t)header->nodecount * sizeof(ImageNode) + (size_t)header->funccount * sizeof(ImageFunction)
+                    + (size_t)header->paramcount * sizeof(ImageString) + bindingcount * sizeof(ImageBinding) + header->stringbytes;
+    if(memcmp(header->magic, imagemagic, sizeof(imagemagic)) != 0 || expected != size){
+        munmap(mapped, size);
+        return false;
+    }
+
+    const ImageNode* records = (const ImageNode*)(base + sizeof(ImageHeader));
+    const ImageFunction* funcs = (const ImageFunction*)(records + header->nodecount);
+    const ImageString* params = (const ImageString*)(funcs + header->funccount);
+    const ImageBinding* bindings = (const ImageBinding*)(params + header->paramcount);
+    const char* strings = (const char*)(bindings + bindingcount);
+
+    auto text = [&](const ImageString& str){ return string(strings + str.offset, str.length); };
+    auto validstring = [&](const ImageString& str){ return (uint64_t)str.offset + str.length <= header->stringbytes; };
+    auto validnode = [&](int32_t i){ return i >= -1 && i < (int64_t)header->nodecount; };
+
+    bool valid = true;
+    for(uint32_t i = 0; i < header->nodecount; i++)
+        valid = valid && records[i].type <= (uint8_t)nodetype::NIL && records[i].atomtype <= (uint8_t)tokentype::PROMISE
+                      && validstring(records[i].content) && validnode(records[i].left) && validnode(records[i].right);
+    for(uint32_t i = 0; i < header->funccount; i++)
+        valid = valid && funcs[i].label >= 0 && validnode(funcs[i].label) && funcs[i].body >= 0 && validnode(funcs[i].body)
+                      && (uint64_t)funcs[i].firstparam + funcs[i].paramcount <= header->paramcount;
+    for(uint32_t i = 0; i < header->paramcount; i++)
+        valid = valid && validstring(params[i]);
+    for(size_t i = 0; i < bindingcount; i++)
+        valid = valid && validstring(bindings[i].name) && validstring(bindings[i].alias) && validnode(bindings[i].node);
+
+    if(!valid){
+        munmap(mapped, size);
+        return false;
+    }
+
+    vector<TreeNode*> nodes(header->nodecount);
+    for(uint32_t i = 0; i < header->nodecount; i++){
+        nodes[i] = new TreeNode(text(records[i].content), (tokentype)records[i].atomtype);
+        nodes[i]->type = (nodetype)records[i].type;
+        nodes[i]->line = records[i].line;
+        nodes[i]->column = records[i].column;
+    }
+
+    for(uint32_t i = 0; i < header->nodecount; i++){
+        if(records[i].left >= 0) nodes[i]->left = nodes[records[i].left];
+        if(records[i].right >= 0) nodes[i]->right = nodes[records[i].right];
+    }
+
+    for(uint32_t i = 0; i < header->funccount; i++){
+        vector<string> parameters;
+        for(uint32_t p = 0; p < funcs[i].paramcount; p++){
+            parameters.push_back(text(params[funcs[i].firstparam + p]));
+            addlocalname(parameters.back());
+        }
+
+        nodes[funcs[i].label]->function = new UserFunction(parameters, nodes[funcs[i].body]);
+    }
+
+    unique_lock<shared_mutex> guard(session->envlock);
+    for(size_t i = 0; i < bindingcount; i++){
+        if(bindings[i].node >= 0)
+            session->definetable[text(bindings[i].name)] = nodes[bindings[i].node];
+        else
+            session->functionalias[text(bindings[i].name)] = text(bindings[i].alias);
+    }
+
+    munmap(mapped, size);
+    session->envversion = ++versioncounter;
+    return true;
+}
+
+TreeNode* eval(TreeNode* node, bool islet ){
+    if(node == nullptr) return nullptr;
+    if(checksteps()) countstep();
+
+    if(node->type == nodetype::ATOM) return atom(node);
+
+    if(node->type == nodetype::CONS && node->left->atomtype == tokentype::SYMBOL && node->left->content == "lambda")
+        return lambda(node);
+
+    if(node->type == nodetype::CONS){
+        if(node->left->type == nodetype::CONS && node->left->left->atomtype == tokentype::SYMBOL && node->left->left->content == "lambda") {
+            TreeNode* built = lambda(node->left);
+            try{
+                return userfunc(node, built, findfunction(built), islet, node == rootform);
+            }
+            catch(EvalError& error){
+                if(error.type == 6) error.token = copy(node);
+                throw;
+            }
+        }
+
+        TreeNode* funcNode = evalarg(node->left, 10);
+        string op = funcNode->content;
+        if(!ischecked(node, checkedlist)){
+            if(!islist(node))
+                throw EvalError(4, restorename(op), copy(node));
+            markchecked(node, checkedlist);
         }
+
+        UserFunction* fn = findfunction(funcNode);
+        if(fn != nullptr)
+            return userfunc(node, funcNode, fn);
+
+        ProfileFrame frame(node, funcNode);
         if(op == "#<procedure quote>"){
             
             return quote(node);
         }
         else if(op == "#<procedure define>"){
-            if(toplevel > 1){
-                cout << endl << "> ERROR (level of DEFINE)" << endl;
-                evalerror = true;
-                return nullptr;
-            }
+            if(node != rootform)
+                throw EvalError(12, "DEFINE", nullptr);
             
             return define(node);
         }
@@ -2049,205 +4268,1099 @@ TreeNode* eval(TreeNode* node, bool islet ){
             return condition(node);
         } 
         else if(op == "#<procedure lambda>"){
-            /*TreeNode* temp = copy(node);
-            temp->left = funcNode;*/
-            return userfunc(node, islet);
+            return lambda(node);
         }
         else if(op == "#<procedure let>"){
             return let(node);
         }
+        else if(op == "#<procedure do>"){
+            return doloop(node);
+        }
+        else if(op == "#<procedure pmap>" || op == "#<procedure pfor-each>"){
+            return parallelmap(op, node);
+        }
+        else if(islistlibrary(op)){
+            return listlibrary(op, node);
+        }
+        else if(op == "#<procedure future>"){
+            return makefuture(node);
+        }
+        else if(op == "#<procedure touch>"){
+            return touch(node);
+        }
+        else if(op == "#<procedure delay>" || op == "#<procedure force>" || op == "#<procedure make-promise>"
+                || op == "#<procedure cons-stream>" || op == "#<procedure stream-car>" || op == "#<procedure stream-cdr>"){
+            return lazy(op, node);
+        }
         else if(op == "#<procedure verbose?>"){
-            return verbose ? truenode() : falsenode();
+            return session->verbose ? truenode() : falsenode();
         }        
         else if(op == "#<procedure verbose>"){
-            if(node->right->type == nodetype::NIL || node->right->right->type != nodetype::NIL){
-                errortype = 2;
-                evalerror = true;
-                errorop = restorename(op);
-                return nullptr;
-            }
+            if(node->right->type == nodetype::NIL || node->right->right->type != nodetype::NIL)
+                throw EvalError(2, restorename(op), nullptr);
+
             if(node->right->left->atomtype == tokentype::NIL){
-                verbose = false;
+                session->verbose = false;
                 needprint = false;
                 return falsenode();
             }
             
             else{
-                TreeNode* result = eval(node->right->left);
-                if(evalerror){
-                    if(errortype == 6) errortype = 7;
-                    return nullptr;
-                } 
-                verbose = true;
+                evalarg(node->right->left);
+                session->verbose = true;
                 return truenode();
             }
         }
-        else if(op == "#<procedure exit>"){
-            if(toplevel > 1){
-                cout << endl << "> ERROR (level of EXIT)" << endl;
-                evalerror = true;
-                return nullptr;
-            } 
+        else if(op == "#<procedure exit>"){
+            if(node != rootform)
+                throw EvalError(12, "EXIT", nullptr);
+
+            return exit(node);
+        }
+        else if(op == "#<procedure clean-environment>"){
+            if(node != rootform)
+                throw EvalError(12, "CLEAN-ENVIRONMENT", nullptr);
+            
+            if(node->right->type != nodetype::NIL)
+                throw EvalError(2, "clean-environment", nullptr);
+
+            clear();
+            if(session->verbose) *outstream << endl << "> environment cleaned" << endl;
+            needprint = false;
+            return truenode();
+        }
+        else if(op == "#<procedure define-syntax>"){
+            if(node != rootform)
+                throw EvalError(12, "DEFINE-SYNTAX", nullptr);
+
+            return definesyntax(node);
+        }
+        else if(op == "#<procedure save-image>"){
+            if(node != rootform)
+                throw EvalError(12, "SAVE-IMAGE", nullptr);
+
+            if(node->right->type == nodetype::NIL || node->right->right->type != nodetype::NIL)
+                throw EvalError(2, restorename(op), nullptr);
+
+            TreeNode* path = evalarg(node->right->left);
+            if(path->atomtype != tokentype::STRING)
+                throw EvalError(5, restorename(op), copy(path));
+
+            if(!saveimage(path->content.substr(1, path->content.size() - 2)))
+                throw EvalError(14, path->content, nullptr);
+
+            if(session->verbose) *outstream << endl << "> image saved" << endl;
+            needprint = false;
+            return truenode();
+        }
+        
+        else
+            throw EvalError(13, op, funcNode);
+    }
+
+    return node;
+}
+
+void printsyntaxerror(){
+    errorsreported++;
+    if(errortype == 3)   *outstream << endl << "> ERROR (no closing quote) : END-OF-LINE encountered at Line " << errortoken.row << " Column "<< errortoken.col << endl;
+    else if(errortype == 2){
+        *outstream << endl << "> ERROR (unexpected token) : atom or '(' expected when token at Line "<< errortoken.row << " Column " << errortoken.col << " is >>" << errortoken.content << "<<" << endl;
+    }
+
+    else *outstream << endl << "> ERROR (unexpected token) : ')' expected when token at Line "<< errortoken.row << " Column " << errortoken.col << " is >>" << errortoken.content << "<<" << endl;
+}
+
+void printevalerror(const EvalError& error){
+    errorsreported++;
+    int lprint = 0;
+    if(error.type == 1)
+        *outstream << endl << "> ERROR (unbound symbol) : " << error.op << endl; 
+    else if(error.type == 2)
+        *outstream << endl << "> ERROR (incorrect number of arguments) : " << error.op << endl;
+    else if(error.type == 3){
+        if(error.token->left->content == "define")
+            *outstream << endl << "> ERROR (DEFINE format) : ";
+        else if(error.token->left->content == "cond")
+            *outstream << endl << "> ERROR (COND format) : ";
+        else if(error.token->left->content == "lambda")
+            *outstream << endl << "> ERROR (LAMBDA format) : ";
+        else if(error.token->left->content == "let")
+            *outstream << endl << "> ERROR (LET format) : ";
+        else if(error.token->left->content == "do")
+            *outstream << endl << "> ERROR (DO format) : ";
+        else if(error.token->left->content == "define-syntax")
+            *outstream << endl << "> ERROR (DEFINE-SYNTAX format) : ";
+        print(error.token, lprint);
+    }        
+    
+    else if(error.type == 4){
+        *outstream << endl << "> ERROR (non-list) : ";
+        print(error.token, lprint);
+    }
+    else if(error.type == 5){
+        *outstream << endl << "> ERROR (" << error.op << " with incorrect argument type) : ";
+        print(error.token, lprint);
+    }
+    else if(error.type == 6 || error.type == 10){
+        *outstream << endl << "> ERROR (no return value) : ";
+        print(error.token, lprint);
+    }
+    else if(error.type == 7){
+        *outstream << endl << "> ERROR (unbound parameter) : ";
+        print(error.token, lprint);        
+    }
+    else if(error.type == 8){
+        *outstream << endl << "> ERROR (unbound test-condition) : ";
+        print(error.token, lprint);        
+    }
+    else if(error.type == 9){
+        *outstream << endl << "> ERROR (unbound condition) : ";
+        print(error.token, lprint);        
+    }
+    else if(error.type == 11)
+        *outstream << endl << "> ERROR (division by zero) : " << error.op << endl;
+    else if(error.type == 12)
+        *outstream << endl << "> ERROR (level of " << error.op << ")" << endl;
+    else if(error.type == 13){
+        *outstream << endl << "> ERROR (attempt to apply non-function) : ";
+        if(error.token->type != nodetype::ATOM) print(error.token, lprint);
+        else if(!isreserved(error.op) && error.token->atomtype == tokentype::FLOAT) *outstream << roundto(error.op) << endl;
+        else *outstream << error.op << endl;
+    }
+    else if(error.type == 14)
+        *outstream << endl << "> ERROR (cannot write image) : " << error.op << endl;
+    else if(error.type == 15){
+        *outstream << endl << "> ERROR (no matching syntax rule) : ";
+        print(error.token, lprint);
+    }
+    else if(error.type == 16)
+        *outstream << endl << "> ERROR (" << error.op << " limit exceeded)" << endl;
+    else if(error.type == 17)
+        *outstream << endl << "> ERROR (evaluation cancelled)" << endl;
+}
+
+string cachedir = getenv("HOME") != nullptr ? string(getenv("HOME")) + "/.cache/ourscheme" : "";
+
+const char cachemagic[8] = {'O', 'S', 'C', 'A', 'C', 'H', 'E', '2'};
+
+uint64_t hashsource(const string& source){
+    uint64_t hash = 14695981039346656037ull;
+    for(unsigned char c : source){
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+string cachepath(uint64_t hash){
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.osc", (unsigned long long)hash);
+    return cachedir + name;
+}
+
+void putvarint(string& out, uint64_t value){
+    while(value >= 0x80){
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+
+    out += (char)value;
+}
+
+bool getvarint(const string& in, size_t& pos, uint64_t& value){
+    value = 0;
+    for(int shift = 0; pos < in.size() && shift < 64; shift += 7){
+        unsigned char byte = in[pos++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+
+    return false;
+}
+
+struct CacheWriter{
+    string body;
+    vector<string> texts;
+    map<string, uint64_t> interned;
+
+    void text(const string& str){
+        auto it = interned.find(str);
+        if(it == interned.end()){
+            it = interned.emplace(str, texts.size()).first;
+            texts.push_back(str);
+        }
+
+        putvarint(body, it->second);
+    }
+
+    void form(TreeNode* node){
+        while(node != nullptr && node->type == nodetype::CONS){
+            body += (char)(node->line > 0 ? 4 : 3);
+            text(node->content);
+            if(node->line > 0){
+                putvarint(body, node->line);
+                putvarint(body, node->column);
+            }
+
+            form(node->left);
+            node = node->right;
+        }
 
-            return exit(node);
+        if(node == nullptr)
+            body += (char)0;
+        else if(node->type == nodetype::NIL)
+            body += (char)1;
+        else{
+            body += (char)2;
+            body += (char)node->atomtype;
+            text(node->content);
         }
-        else if(op == "#<procedure clean-environment>"){
-            if(toplevel > 1){
-                cout << endl << "> ERROR (level of CLEAN-ENVIRONMENT)" << endl;
-                evalerror = true;
-                return nullptr;
+    }
+};
+
+struct CacheReader{
+    const string& in;
+    size_t pos;
+    vector<string> texts;
+
+    CacheReader(const string& data) : in(data), pos(0) {}
+
+    bool text(string& str){
+        uint64_t id;
+        if(!getvarint(in, pos, id) || id >= texts.size()) return false;
+        str = texts[id];
+        return true;
+    }
+
+    bool form(TreeNode*& result){
+        TreeNode** slot = &result;
+        while(pos < in.size()){
+            unsigned char tag = in[pos++];
+            string content;
+            if(tag == 0){
+                *slot = nullptr;
+                return true;
             }
-            
-            if(node->right->type == nodetype::NIL){
-                clear();
-                if(verbose) cout << endl << "> environment cleaned" << endl;
-                needprint = false;
-                return truenode();
+
+            if(tag == 1){
+                *slot = new TreeNode(nodetype::NIL);
+                return true;
             }
-            
-            else{
-                cout << endl << "> ERROR (incorrect number of arguments) : clean-environment" << endl;
-                evalerror = true;
-                return nullptr;
+
+            if(tag == 2){
+                if(pos >= in.size() || (unsigned char)in[pos] > (unsigned char)tokentype::ATOM) return false;
+                tokentype type = (tokentype)in[pos++];
+                if(!text(content)) return false;
+                *slot = new TreeNode(content, type);
+                return true;
+            }
+
+            if((tag != 3 && tag != 4) || !text(content)) return false;
+            TreeNode* cons = new TreeNode(content, nullptr, nullptr);
+            if(tag == 4){
+                uint64_t line, column;
+                if(!getvarint(in, pos, line) || !getvarint(in, pos, column)) return false;
+                cons->line = (int)line;
+                cons->column = (int)column;
             }
-        }
-        
-        else{
-            int l = 0;
-            cout << endl << "> ERROR (attempt to apply non-function) : ";
-            if(funcNode->type != nodetype::ATOM) print(funcNode, l);
-            else{
-                if(!isreserved(op) && funcNode->atomtype == tokentype::FLOAT) cout << roundto(op) << endl;
-                else cout << op << endl;
-            } 
 
-            evalerror = true;
-            return nullptr;
+            if(!form(cons->left)) return false;
+            *slot = cons;
+            slot = &cons->right;
         }
+
+        return false;
     }
+};
 
-    return node;
-}
+void writecache(uint64_t hash, const vector<TreeNode*>& forms){
+    if(cachedir.empty()) return;
 
-void printsyntaxerror(){
-    if(errortype == 3)   cout << endl << "> ERROR (no closing quote) : END-OF-LINE encountered at Line " << errortoken.row << " Column "<< errortoken.col << endl;
-    else if(errortype == 2){
-        cout << endl << "> ERROR (unexpected token) : atom or '(' expected when token at Line "<< errortoken.row << " Column " << errortoken.col << " is >>" << errortoken.content << "<<" << endl;
+    CacheWriter writer;
+    for(TreeNode* root : forms)
+        writer.form(root);
+
+    string data(cachemagic, sizeof(cachemagic));
+    putvarint(data, hash);
+    putvarint(data, writer.texts.size());
+    for(const string& str : writer.texts){
+        putvarint(data, str.size());
+        data += str;
     }
 
-    else cout << endl << "> ERROR (unexpected token) : ')' expected when token at Line "<< errortoken.row << " Column " << errortoken.col << " is >>" << errortoken.content << "<<" << endl;
+    putvarint(data, forms.size());
+    data += writer.body;
+
+    size_t slash = 0;
+    while((slash = cachedir.find('/', slash + 1)) != string::npos)
+        mkdir(cachedir.substr(0, slash).c_str(), 0755);
+    mkdir(cachedir.c_str(), 0755);
+
+    string path = cachepath(hash);
+    string temp = path + "." + to_string(getpid());
+    ofstream out(temp, ios::binary | ios::trunc);
+    out.write(data.data(), data.size());
+    out.close();
+    if(!out || rename(temp.c_str(), path.c_str()) != 0) remove(temp.c_str());
 }
 
-void printevalerror(){
-    int lprint = 0;
-    if(errortype == 1)
-        cout << endl << "> ERROR (unbound symbol) : " << errorop << endl; 
-    else if(errortype == 2)
-        cout << endl << "> ERROR (incorrect number of arguments) : " << errorop << endl;
-    else if(errortype == 3){
-        if(evalerrortoken->left->content == "define")
-            cout << endl << "> ERROR (DEFINE format) : ";
-        else if(evalerrortoken->left->content == "cond")
-            cout << endl << "> ERROR (COND format) : ";
-        else if(evalerrortoken->left->content == "lambda")
-            cout << endl << "> ERROR (LAMBDA format) : ";
-        else if(evalerrortoken->left->content == "let")
-            cout << endl << "> ERROR (LET format) : ";
-        print(evalerrortoken, lprint);
-    }        
-    
-    else if(errortype == 4){
-        cout << endl << "> ERROR (non-list) : ";
-        print(evalerrortoken, lprint);
+bool readcache(uint64_t hash, vector<TreeNode*>& forms){
+    if(cachedir.empty()) return false;
+
+    ifstream file(cachepath(hash), ios::binary);
+    if(!file) return false;
+
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    if(data.size() < sizeof(cachemagic) || memcmp(data.data(), cachemagic, sizeof(cachemagic)) != 0) return false;
+
+    CacheReader reader(data);
+    reader.pos = sizeof(cachemagic);
+    uint64_t stored, count, length;
+    if(!getvarint(data, reader.pos, stored) || stored != hash) return false;
+    if(!getvarint(data, reader.pos, count)) return false;
+
+    for(uint64_t i = 0; i < count; i++){
+        if(!getvarint(data, reader.pos, length) || length > data.size() - reader.pos) return false;
+        reader.texts.push_back(data.substr(reader.pos, length));
+        reader.pos += length;
     }
-    else if(errortype == 5){
-        cout << endl << "> ERROR (" << errorop << " with incorrect argument type) : ";
-        print(evalerrortoken, lprint);
+
+    if(!getvarint(data, reader.pos, count)) return false;
+    vector<TreeNode*> parsed;
+    for(uint64_t i = 0; i < count; i++){
+        TreeNode* root = nullptr;
+        if(!reader.form(root) || root == nullptr) return false;
+        parsed.push_back(root);
     }
-    else if(errortype == 6 || errortype == 10){
-        cout << endl << "> ERROR (no return value) : ";
-        print(evalerrortoken, lprint);
+
+    if(reader.pos != data.size()) return false;
+    forms.insert(forms.end(), parsed.begin(), parsed.end());
+    return true;
+}
+
+bool parsesource(vector<TreeNode*>& forms){
+    do{
+        reset();
+        if(!readinput()) return true;
+        int index = 0;
+        while(index < tokens.size()){
+            TreeNode* root = parse(tokens, index);
+            if(tokens.size() >= 3 && tokens[0].content == "(" && tokens[1].content == "exit" && tokens[2].content == ")") return true;
+            if(syntaxerror){
+                printsyntaxerror();
+                return false;
+            }
+
+            if(eof) return false;
+            forms.push_back(root);
+        }
+    }   while(!eof);
+
+    return true;
+}
+
+// Evaluates one top-level form within the configured budgets.
+TreeNode* evalform(TreeNode* root){
+    TraceSpan span("eval", root);
+    startbudget();
+    try{
+        root = expand(root);
+        rootform = root;
+        root = eval(root);
     }
-    else if(errortype == 7){
-        cout << endl << "> ERROR (unbound parameter) : ";
-        print(evalerrortoken, lprint);        
+    catch(EvalError&){
+        adoptbudget(nullptr);
+        leaveepoch();
+        throw;
     }
-    else if(errortype == 8){
-        cout << endl << "> ERROR (unbound test-condition) : ";
-        print(evalerrortoken, lprint);        
+
+    adoptbudget(nullptr);
+    leaveepoch();
+    return root;
+}
+
+bool loadfile(const string& path){
+    ifstream file(path, ios::binary);
+    if(!file) return false;
+
+    string source((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    uint64_t hash = hashsource(source);
+    vector<TreeNode*> forms;
+    if(!readcache(hash, forms)){
+        istringstream in(source);
+        istream* previous = instream;
+        int previousline = inputline;
+        instream = &in;
+        inputline = 0;
+        bool parsed = parsesource(forms);
+        instream = previous;
+        inputline = previousline;
+        if(parsed) writecache(hash, forms);
     }
-    else if(errortype == 9){
-        cout << endl << "> ERROR (unbound condition) : ";
-        print(evalerrortoken, lprint);        
+
+    bool wasverbose = session->verbose;
+    session->verbose = false;
+    for(TreeNode* root : forms){
+        reset();
+        try{
+            evalform(root);
+        }
+        catch(EvalError& error){
+            printevalerror(error);
+        }
     }
+
+    session->verbose = wasverbose;
+    reset();
+    return true;
 }
 
-int main(){
-    string question ;
-    cout << "Welcome to OurScheme!" << endl;
-    getline(cin, question);
-    string inp;    
-    int index = 0, start = index, lprint = 0;
-    bool already = false;
+enum class replend{ EXIT, END, ERROR };
+
+// The loop behind repl() and Interpreter::eval(): reads, evaluates and prints
+// forms until (exit) or the end of input. With stoponerror it returns at the
+// first error reported instead; last then holds the value of the last form
+// evaluated and formstart where the output of the form being read began.
+replend readevalprint(bool stoponerror, TreeNode** last = nullptr, streampos* formstart = nullptr){
+    int index = 0, lprint = 0;
     TreeNode* root = nullptr;
     do{
         reset();
-        already = false;
         root = nullptr;
         if(!readinput())break;
         lprint = 0;
         index = 0; 
         while(index < tokens.size()){
+            if(formstart != nullptr) *formstart = outstream->tellp();
             existtree = true;
-            evalerror = false;
-            root = parse(tokens, index);
+            {
+                TraceSpan span("parse");
+                root = parse(tokens, index);
+                span.call = root;
+            }
+
             if(syntaxerror || checkexit(root) || eof){
                 index = tokens.size();
             }   
             
             else{
-                root = eval(root);
-                //if(checkexit(root)) break;
-
-                if(evalerror){
-                    printevalerror();
-                    already = true;
+                try{
+                    root = evalform(root);
+                }
+                catch(EvalError& error){
+                    printevalerror(error);
+                    if(stoponerror) return replend::ERROR;
                     root = nullptr;   
-                    toplevel = 0; 
                     continue;
                 }
 
-                else{
-                    if(checkexit(root)) break;
-                    if(needprint){
-                        cout << endl << "> " ;
-                        print(root, lprint);                        
-                    }
-
-                    errorop = "";
-                    needprint = true;
-                    existtree = false;
-                    root = nullptr;        
-                    toplevel = 0;
+                if(checkexit(root)) break;
+                if(last != nullptr) *last = root;
+                if(needprint){
+                    TraceSpan span("print", root);
+                    *outstream << endl << "> " ;
+                    print(root, lprint);                        
                 }
+
+                needprint = true;
+                existtree = false;
+                root = nullptr;        
             }
         }
 
         if(checkexit(root) || ( tokens.size() >= 3 && tokens[0].content == "(" && tokens[1].content == "exit" && tokens[2].content == ")") ){
-            cout << endl << "> ";
-            break;
+            return replend::EXIT;
+        }
+
+        else if(stoponerror && eof){
+            errorsreported++;
+            *outstream << endl << "> ERROR (no more input) : END-OF-FILE encountered" << endl;
+            return replend::ERROR;
         }
 
         else if(syntaxerror){
             printsyntaxerror();
+            if(stoponerror) return replend::ERROR;
         }
 
-        else if(evalerror && !already){
-            printevalerror();
+    }   while(!eof && !checkexit(root));
+
+    return replend::END;
+}
+
+// Every REPL the program runs, on stdin, a --batch file or a --server
+// connection, starts here: the banner, then the test number line the input
+// opens with, which is skipped, then the forms.
+void repl(){
+    string question;
+    *outstream << "Welcome to OurScheme!" << endl;
+    getline(*instream, question);
+    inputline++;
+
+    if(readevalprint(false) == replend::EXIT) *outstream << endl << "> ";
+
+    if(eof){
+        errorsreported++;
+        *outstream << endl << "> ERROR (no more input) : END-OF-FILE encountered";
+    }
+    *outstream << endl << "Thanks for using OurScheme!";
+}
+
+ourscheme::Value tovalue(TreeNode* node){
+    ourscheme::Value value;
+    if(node->type == nodetype::NIL){
+        value.kind = ourscheme::ValueKind::NIL;
+        return value;
+    }
+
+    if(node->type == nodetype::CONS){
+        value.kind = ourscheme::ValueKind::LIST;
+        TreeNode* cur = node;
+        while(cur->type == nodetype::CONS){
+            value.items.push_back(tovalue(cur->left));
+            cur = cur->right;
         }
 
-    }   while(!eof && !checkexit(root));
+        if(cur->type == nodetype::ATOM && cur->atomtype != tokentype::NIL)
+            value.tail.push_back(tovalue(cur));
+        return value;
+    }
+
+    Numbertype num = stringtrans(node);
+    if(node->atomtype == tokentype::INT){
+        value.kind = ourscheme::ValueKind::INT;
+        value.intValue = num.intValue;
+    }
+    else if(node->atomtype == tokentype::FLOAT){
+        value.kind = ourscheme::ValueKind::FLOAT;
+        value.floatValue = num.floatValue;
+    }
+    else if(node->atomtype == tokentype::STRING){
+        value.kind = ourscheme::ValueKind::STRING;
+        value.text = node->content.substr(1, node->content.size() - 2);
+    }
+    else if(node->atomtype == tokentype::T)
+        value.kind = ourscheme::ValueKind::T;
+    else if(node->atomtype == tokentype::NIL)
+        value.kind = ourscheme::ValueKind::NIL;
+    else if(isprocedure(node->content)){
+        value.kind = ourscheme::ValueKind::PROCEDURE;
+        value.text = restorename(node->content);
+    }
+    else{
+        value.kind = ourscheme::ValueKind::SYMBOL;
+        value.text = node->content;
+    }
+
+    return value;
+}
+
+}
+
+using namespace ourscheme::internal;
+
+ourscheme::Interpreter::Interpreter() : state(new Session()) {}
+
+ourscheme::Interpreter::Interpreter(const Interpreter& base) : state(new Session(*base.state)) {}
+
+ourscheme::Interpreter::~Interpreter(){
+    cancelfutures(state);
+    waitfutures(state);
+    delete state;
+}
+
+bool ourscheme::Interpreter::load(const string& path){
+    ostringstream out;
+    Session* savedsession = session;
+    ostream* savedout = outstream;
+    session = state;
+    outstream = &out;
+    bool loaded = loadfile(path);
+    session = savedsession;
+    outstream = savedout;
+    return loaded && out.str().empty();
+}
+
+bool ourscheme::Interpreter::loadimage(const string& path){
+    Session* savedsession = session;
+    session = state;
+    bool loaded = internal::loadimage(path);
+    session = savedsession;
+    return loaded;
+}
+
+ourscheme::Result ourscheme::Interpreter::eval(string_view source){
+    Result result;
+    istringstream in{string(source)};
+    ostringstream out;
+    Session* savedsession = session;
+    istream* savedin = instream;
+    ostream* savedout = outstream;
+    int savedline = inputline;
+    session = state;
+    instream = &in;
+    outstream = &out;
+    inputline = 0;
+
+    TreeNode* last = nullptr;
+    streampos formstart = 0;
+    result.ok = readevalprint(true, &last, &formstart) != replend::ERROR;
+    result.output = out.str();
+    if(!result.ok){
+        result.error = result.output.substr(formstart);
+        size_t start = result.error.find("> ");
+        result.error = start == string::npos ? result.error : result.error.substr(start + 2);
+        while(!result.error.empty() && result.error.back() == '\n') result.error.pop_back();
+    }
+    else if(last != nullptr) result.value = tovalue(last);
+
+    reset();
+    session = savedsession;
+    instream = savedin;
+    outstream = savedout;
+    inputline = savedline;
+    return result;
+}
+
+namespace ourscheme::internal{
+
+struct FdBuffer : public streambuf{
+    int fd;
+    char inbuf[4096];
+    char outbuf[4096];
+
+    FdBuffer(int f) : fd(f) {
+        setg(inbuf, inbuf, inbuf);
+        setp(outbuf, outbuf + sizeof(outbuf));
+    }
+
+    int underflow() override {
+        ssize_t count;
+        do count = read(fd, inbuf, sizeof(inbuf));
+        while(count < 0 && errno == EINTR);
+
+        if(count <= 0) return traits_type::eof();
+        setg(inbuf, inbuf, inbuf + count);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    int overflow(int c) override {
+        if(sync() != 0) return traits_type::eof();
+        if(c != traits_type::eof()){
+            *pptr() = c;
+            pbump(1);
+        }
+
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        char* cur = pbase();
+        while(cur < pptr()){
+            ssize_t count = send(fd, cur, pptr() - cur, MSG_NOSIGNAL);
+            if(count < 0 && errno == EINTR) continue;
+            if(count <= 0) return -1;
+            cur += count;
+        }
+
+        setp(outbuf, outbuf + sizeof(outbuf));
+        return 0;
+    }
+};
+
+// Connections being served by number, so a stopping server can end their
+// sessions, and the numbers of sessions whose thread is done, to be joined.
+struct Client{
+    int fd;
+    Session* session;  // nullptr until the session starts
+};
+
+mutex clientlock;
+map<int, Client> clients;
+vector<int> finishedclients;
+
+// Set when the server stops; every session and the tasks it starts take it
+// as their cancellation flag, so a running form ends at its next step.
+atomic<bool> serverstopping{false};
+
+void runsession(int number, int fd){
+    Session* own = new Session(mainsession);
+    {
+        lock_guard<mutex> guard(clientlock);
+        clients[number].session = own;
+    }
+
+    FdBuffer buffer(fd);
+    istream in(&buffer);
+    ostream out(&buffer);
+    session = own;
+    instream = &in;
+    outstream = &out;
+    cancelflag = &serverstopping;
+
+    repl();
+    out.flush();
+    {
+        lock_guard<mutex> guard(clientlock);
+        clients.erase(number);
+    }
+
+    close(fd);
+    cancelfutures(own);
+    waitfutures(own);
+    delete own;
+
+    lock_guard<mutex> guard(clientlock);
+    finishedclients.push_back(number);
+}
+
+// Joins the threads of sessions that have ended.
+void joinfinished(map<int, thread>& threads){
+    vector<int> finished;
+    {
+        lock_guard<mutex> guard(clientlock);
+        finished.swap(finishedclients);
+    }
+
+    for(int number : finished){
+        threads[number].join();
+        threads.erase(number);
+    }
+}
+
+// SIGINT and SIGTERM write a byte here, waking the accept loop in serve().
+int stoppipe[2] = { -1, -1 };
+
+void requeststop(int){
+    char byte = 0;
+    ssize_t written = write(stoppipe[1], &byte, 1);
+    (void)written;
+}
+
+// Ends every session: its running form and futures are cancelled, and its
+// connection is shut down so repl() then reads end of input.
+void stopsessions(){
+    serverstopping = true;
+    lock_guard<mutex> guard(clientlock);
+    for(auto& client : clients){
+        shutdown(client.second.fd, SHUT_RDWR);
+        if(client.second.session != nullptr) cancelfutures(client.second.session);
+    }
+}
+
+int serve(const string& path){
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path)){
+        cerr << "socket path too long: " << path << endl;
+        return 1;
+    }
+
+    strcpy(addr.sun_path, path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if(listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0){
+        cerr << "cannot listen on " << path << endl;
+        return 1;
+    }
+
+    if(pipe(stoppipe) != 0){
+        cerr << "cannot listen on " << path << endl;
+        return 1;
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = requeststop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    int status = 1;
+    int served = 0;
+    map<int, thread> threads;
+    while(true){
+        pollfd fds[2] = { { listener, POLLIN, 0 }, { stoppipe[0], POLLIN, 0 } };
+        if(poll(fds, 2, -1) < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+
+        if(fds[1].revents != 0){
+            status = 0;
+            break;
+        }
+
+        int client = accept(listener, nullptr, nullptr);
+        if(client < 0){
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+
+        joinfinished(threads);
+        lock_guard<mutex> guard(clientlock);
+        clients[++served] = { client, nullptr };
+        threads[served] = thread(runsession, served, client);
+    }
+
+    close(listener);
+    unlink(path.c_str());
+    stopsessions();
+    for(auto& pair : threads)
+        pair.second.join();
+
+    return status;
+}
+
+struct BatchResult{
+    string output;
+    int status = 0;
+    bool done = false;
+};
+
+// Runs one script the way `ourscheme < path` would, in a session of its own
+// copied from the one --image and --load prepared. The status is 0 when no
+// error was reported, 1 when one was and 2 when the file cannot be read.
+void runbatchfile(const string& path, BatchResult& result){
+    ifstream file(path, ios::binary);
+    if(!file){
+        result.status = 2;
+        return;
+    }
+
+    Session* own = new Session(mainsession);
+
+    ostringstream out;
+    session = own;
+    instream = &file;
+    outstream = &out;
+    localtable.clear();
+    errorsreported = 0;
+    inputline = 0;
+    reset();
+
+    repl();
+
+    result.output = out.str();
+    result.status = errorsreported == 0 ? 0 : 1;
+    session = &mainsession;
+    instream = &cin;
+    outstream = &cout;
+    cancelfutures(own);
+    waitfutures(own);
+    delete own;
+}
+
+// --batch: the files run on one thread per core, and each one's output is
+// written as soon as it and every file before it have finished.
+int runbatch(const vector<string>& paths){
+    vector<BatchResult> results(paths.size());
+    atomic<size_t> next(0);
+    mutex donelock;
+    condition_variable donewake;
+
+    vector<thread> threads;
+    size_t count = min<size_t>(paths.size(), max(1u, thread::hardware_concurrency()));
+    for(size_t t = 0; t < count; t++){
+        threads.emplace_back([&]{
+            for(size_t i = next++; i < paths.size(); i = next++){
+                runbatchfile(paths[i], results[i]);
+                {
+                    lock_guard<mutex> guard(donelock);
+                    results[i].done = true;
+                }
+                donewake.notify_all();
+            }
+        });
+    }
+
+    int status = 0;
+    for(size_t i = 0; i < paths.size(); i++){
+        {
+            unique_lock<mutex> guard(donelock);
+            donewake.wait(guard, [&]{ return results[i].done; });
+        }
+
+        cout << "==> " << paths[i] << " (status " << results[i].status << ") <==" << endl;
+        cout << results[i].output << endl;
+        if(results[i].status != 0) status = 1;
+    }
+
+    for(thread& worker : threads) worker.join();
+    return status;
+}
+
+// Builtins evaluate their own arguments, so below the top of a sample a
+// builtin is only shown when it calls procedures itself.
+const set<string> profilecallers = {
+    "#<procedure map>", "#<procedure filter>", "#<procedure fold>", "#<procedure sort>",
+    "#<procedure pmap>", "#<procedure pfor-each>", "#<procedure force>", "#<procedure touch>",
+    "#<procedure stream-cdr>"
+};
+
+string profilelabel(TreeNode* call, TreeNode* func){
+    string label = restorename(func->content);
+    if(call != nullptr && call->line > 0)
+        label += " (" + to_string(call->line) + ":" + to_string(call->column) + ")";
+
+    return label;
+}
+
+// Stops sampling and writes one folded stack per line, "outer;...;inner count",
+// the input flamegraph.pl and speedscope read.
+bool writeprofile(const string& path){
+    struct itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+
+    map<string, long long> folded;
+    map<uintptr_t, vector<uintptr_t>> stacks;
+    size_t used = min(profileused.load(), profilecapacity);
+    size_t pos = 0;
+    while(pos + 3 <= used){
+        uintptr_t header = __atomic_load_n(&profilebuffer[pos], __ATOMIC_ACQUIRE);
+        if(header == 0) break;
+
+        size_t depth = header - 1;
+        bool truncated = profilebuffer[pos + 1] & 1;
+        size_t shared = profilebuffer[pos + 2];
+        vector<uintptr_t>& stack = stacks[profilebuffer[pos + 1] >> 1];
+        stack.resize(2 * shared);
+        stack.insert(stack.end(), profilebuffer + pos + 3, profilebuffer + pos + 3 + 2 * (depth - shared));
+        pos += 3 + 2 * (depth - shared);
+
+        string line;
+        for(size_t i = 0; i < depth; i++){
+            TreeNode* func = (TreeNode*)stack[2 * i + 1];
+            if(i + 1 < depth && findfunction(func) == nullptr && !profilecallers.count(func->content)) continue;
+
+            if(!line.empty()) line += ';';
+            line += profilelabel((TreeNode*)stack[2 * i], func);
+        }
+
+        if(truncated) line += ";...";
+        folded[line.empty() ? "[toplevel]" : line]++;
+    }
+
+    if(profiledropped > 0)
+        cerr << "profile: buffer full, " << profiledropped << " samples dropped" << endl;
 
-    if(eof) cout << endl << "> ERROR (no more input) : END-OF-FILE encountered";
-    cout << endl << "Thanks for using OurScheme!";
-}
\ No newline at end of file
+    ofstream out(path, ios::trunc);
+    for(auto& pair : folded)
+        out << pair.first << ' ' << pair.second << '\n';
+
+    return (bool)out;
+}
+
+string jsonstring(const string& str){
+    string quoted = "\"";
+    for(unsigned char c : str){
+        if(c == '"' || c == '\\') quoted += '\\';
+        if(c < 0x20){
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        }
+        else quoted += c;
+    }
+
+    return quoted + "\"";
+}
+
+// Writes every recorded event as a Chrome trace-event "complete" event, which
+// chrome://tracing and Perfetto load directly. Times are in microseconds.
+bool writetrace(const string& path){
+    ofstream out(path, ios::trunc);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    bool first = true;
+    lock_guard<mutex> guard(tracelock);
+    for(TraceLog* log : tracelogs){
+        lock_guard<mutex> logguard(log->lock);
+        for(const TraceEvent& event : log->events){
+            out << (first ? "\n" : ",\n");
+            first = false;
+
+            string name = event.phase != nullptr ? event.phase : restorename(event.func->content);
+            char times[64];
+            snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f", event.begin / 1000.0, (event.end - event.begin) / 1000.0);
+            out << "{\"name\":" << jsonstring(name) << ",\"cat\":\"" << (event.phase != nullptr ? "phase" : "call")
+                << "\",\"ph\":\"X\"," << times << ",\"pid\":1,\"tid\":" << log->thread;
+            if(event.call != nullptr && event.call->line > 0)
+                out << ",\"args\":{\"line\":" << event.call->line << ",\"column\":" << event.call->column << "}";
+            out << "}";
+        }
+    }
+
+    out << "\n]}\n";
+    return (bool)out;
+}
+
+}
+
+#ifndef OURSCHEME_LIBRARY
+int main(int argc, char* argv[]){
+    string image = "";
+    string server = "";
+    string profile = "";
+    string trace = "";
+    vector<string> loads;
+    vector<string> batch;
+    for(int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if(arg == "--batch"){
+            batch.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        else if(arg == "--image" && i + 1 < argc) image = argv[++i];
+        else if(arg == "--max-steps" && i + 1 < argc) maxsteps = atoll(argv[++i]);
+        else if(arg == "--max-nodes" && i + 1 < argc) maxnodes = atoll(argv[++i]);
+        else if(arg == "--timeout" && i + 1 < argc) timeoutms = atoll(argv[++i]);
+        else if(arg == "--load" && i + 1 < argc) loads.push_back(argv[++i]);
+        else if(arg == "--cache-dir" && i + 1 < argc) cachedir = argv[++i];
+        else if(arg == "--server" && i + 1 < argc) server = argv[++i];
+        else if(arg == "--profile" && i + 1 < argc) profile = argv[++i];
+        else if(arg == "--trace" && i + 1 < argc) trace = argv[++i];
+        else if(arg == "--trace-calls") tracecalls = true;
+    }
+
+    budgeted = maxsteps > 0 || maxnodes > 0 || timeoutms > 0;
+    tracing = !trace.empty();
+    tracecalls = tracecalls && tracing;
+    tracestart = chrono::steady_clock::now();
+    if(!profile.empty() && !startprofile()){
+        cerr << "cannot start profiler" << endl;
+        return 1;
+    }
+
+    if(!image.empty() && !loadimage(image)){
+        cerr << "cannot load image: " << image << endl;
+        return 1;
+    }
+
+    for(const string& path : loads){
+        if(!loadfile(path)){
+            cerr << "cannot load file: " << path << endl;
+            return 1;
+        }
+    }
+
+    int status = 0;
+    if(!server.empty()) status = serve(server);
+    else if(!batch.empty()) status = runbatch(batch);
+    else repl();
+
+    if(!profile.empty() && !writeprofile(profile)){
+        cerr << "cannot write profile: " << profile << endl;
+        return 1;
+    }
+
+    if(!trace.empty() && !writetrace(trace)){
+        cerr << "cannot write trace: " << trace << endl;
+        return 1;
+    }
+
+    return status;
+}
+#endif